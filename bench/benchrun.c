@@ -0,0 +1,231 @@
+/*benchrun.c - run a command, report its cost as one json line per run*/
+
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * usage: benchrun [-r runs] [-n name] [-f flags] [-t tree] [-c commit]
+ *	    command [arg ...]
+ *
+ * The command runs with stdout on /dev/null, runs times, and each run
+ * prints
+ *
+ *	{"commit":"..","tree":"..","name":"..","flags":"..","run":1,
+ *	 "wall_ns":..,"user_ns":..,"sys_ns":..,"maxrss_kb":..,"syscalls":..}
+ *
+ * on one line. Wall time is CLOCK_MONOTONIC around fork and wait4, CPU
+ * time and peak RSS come from the rusage of wait4. Syscalls are counted
+ * in one extra run under ptrace, every thread included, since tracing
+ * slows the timed runs down too much; -1 where ptrace is not allowed.
+ * The strings are written as given, callers keep them json safe.
+ */
+
+/*threads tracked at once while counting, -j tops out at 256*/
+#define MAX_TRACED	1024
+
+struct traced {
+	pid_t tid;
+	bool in_syscall;
+};
+
+static pid_t spawn(char *argv[], bool trace);
+static long count_syscalls(char *argv[]);
+static struct traced *find_traced(struct traced *t, int *n, pid_t tid);
+static int64_t tv_ns(const struct timeval *tv);
+static void usage(void);
+
+int main(int argc, char *argv[]) {
+	const char *name = "";
+	const char *flags = "";
+	const char *tree = "";
+	const char *commit = "";
+	struct timespec t0;
+	struct timespec t1;
+	struct rusage ru;
+	long syscalls;
+	char *ep;
+	pid_t pid;
+	int status;
+	int runs;
+	int ch;
+	int i;
+
+	runs = 1;
+	while ((ch = getopt(argc, argv, "+r:n:f:t:c:")) != -1) {
+		switch (ch) {
+		case 'r':
+			runs = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || runs < 1) {
+				errx(1, "invalid runs: %s", optarg);
+			}
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'f':
+			flags = optarg;
+			break;
+		case 't':
+			tree = optarg;
+			break;
+		case 'c':
+			commit = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1) {
+		usage();
+	}
+
+	syscalls = count_syscalls(argv);
+	for (i = 1; i <= runs; i++) {
+		(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+		pid = spawn(argv, false);
+		if (wait4(pid, &status, 0, &ru) < 0) {
+			err(1, "wait4");
+		}
+		(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("%s: exited with status %d", argv[0], status);
+		}
+		(void)printf("{\"commit\":\"%s\",\"tree\":\"%s\",\"name\":\"%s\","
+		    "\"flags\":\"%s\",\"run\":%d,\"wall_ns\":%lld,\"user_ns\":%lld,"
+		    "\"sys_ns\":%lld,\"maxrss_kb\":%ld,\"syscalls\":%ld}\n",
+		    commit, tree, name, flags, i,
+		    (long long)(t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec),
+		    (long long)tv_ns(&ru.ru_utime), (long long)tv_ns(&ru.ru_stime),
+		    ru.ru_maxrss, syscalls);
+		(void)fflush(stdout);
+	}
+	return 0;
+}
+
+/*fork and exec argv, stdout to /dev/null. a traced child stops at exec*/
+static pid_t spawn(char *argv[], bool trace) {
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+			err(1, "/dev/null");
+		}
+		if (trace && ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+			_exit(127);
+		}
+		execvp(argv[0], argv);
+		warn("%s", argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+/*syscalls made by one run of argv, all threads, -1 if it cant be traced*/
+static long count_syscalls(char *argv[]) {
+	static struct traced threads[MAX_TRACED];
+	struct traced *t;
+	long count;
+	pid_t pid;
+	pid_t tid;
+	int nthreads;
+	int status;
+	int sig;
+
+	pid = spawn(argv, true);
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+		/*PTRACE_TRACEME refused, the child gave up*/
+		return -1;
+	}
+	if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	    (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL)) < 0) {
+		(void)kill(pid, SIGKILL);
+		(void)waitpid(pid, &status, 0);
+		return -1;
+	}
+
+	count = 0;
+	nthreads = 0;
+	(void)ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+	for (;;) {
+		if ((tid = waitpid(-1, &status, __WALL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == pid) {
+				/*threads are gone with the process*/
+				break;
+			}
+			/*forget it, the tid may come back for a new thread*/
+			if ((t = find_traced(threads, &nthreads, tid)) != NULL) {
+				*t = threads[--nthreads];
+			}
+			continue;
+		}
+		sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			/*stops alternate entry, exit per thread; count entries*/
+			if ((t = find_traced(threads, &nthreads, tid)) != NULL) {
+				t->in_syscall = !t->in_syscall;
+				if (t->in_syscall) {
+					count++;
+				}
+			}
+		} else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+			/*a real signal, pass it on*/
+			sig = WSTOPSIG(status);
+		}
+		(void)ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(intptr_t)sig);
+	}
+	return count;
+}
+
+/*state for tid, added on first sight. NULL if the table is full*/
+static struct traced *find_traced(struct traced *t, int *n, pid_t tid) {
+	int i;
+
+	for (i = 0; i < *n; i++) {
+		if (t[i].tid == tid) {
+			return &t[i];
+		}
+	}
+	if (*n == MAX_TRACED) {
+		return NULL;
+	}
+	t[*n].tid = tid;
+	t[*n].in_syscall = false;
+	return &t[(*n)++];
+}
+
+static int64_t tv_ns(const struct timeval *tv) {
+	return (int64_t)tv->tv_sec * 1000000000 + (int64_t)tv->tv_usec * 1000;
+}
+
+static void usage(void) {
+	(void)fprintf(stderr, "usage: benchrun [-r runs] [-n name] [-f flags] [-t tree] "
+	    "[-c commit] command [arg ...]\n");
+	exit(1);
+}
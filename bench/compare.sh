@@ -0,0 +1,45 @@
+#!/bin/sh
+# compare.sh - median cost per case of two bench/run.sh result files
+#
+# usage: bench/compare.sh old.jsonl new.jsonl
+#
+# one line per tree and flag set found in both: wall time, cpu time
+# (user + sys), peak RSS and syscalls of the median run by wall time,
+# old then new, and the new/old ratio of wall time.
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 old.jsonl new.jsonl" >&2
+	exit 1
+fi
+
+# "name wall cpu rss syscalls" per run, from the fixed benchrun layout
+fields() {
+	sed -n 's/.*"name":"\([^"]*\)".*"wall_ns":\([0-9]*\),"user_ns":\([0-9]*\),"sys_ns":\([0-9]*\),"maxrss_kb":\([0-9]*\),"syscalls":\(-*[0-9]*\).*/\1 \2 \3 \4 \5 \6/p' "$1" |
+	    awk '{ print $1, $2, $3 + $4, $5, $6 }'
+}
+
+# per name, the run with the median wall time
+medians() {
+	sort -k1,1 -k2,2n | awk '
+	function flush() {
+		if (n == 0)
+			return
+		m = int((n + 1) / 2)
+		print name, w[m], c[m], r[m], s[m]
+	}
+	$1 != name { flush(); name = $1; n = 0 }
+	{ n++; w[n] = $2; c[n] = $3; r[n] = $4; s[n] = $5 }
+	END { flush() }'
+}
+
+fields "$1" | medians | sort -k1,1 > "${TMPDIR:-/tmp}/compare.$$.old"
+fields "$2" | medians | sort -k1,1 > "${TMPDIR:-/tmp}/compare.$$.new"
+join "${TMPDIR:-/tmp}/compare.$$.old" "${TMPDIR:-/tmp}/compare.$$.new" | awk '
+BEGIN { printf "%-16s %10s %10s %10s %10s %9s %9s %9s %9s %6s\n",
+    "case", "wall_ms", "wall_ms", "cpu_ms", "cpu_ms", "rss_kb", "rss_kb", "calls", "calls", "ratio" }
+{
+	printf "%-16s %10.1f %10.1f %10.1f %10.1f %9d %9d %9d %9d %6.2f\n",
+	    $1, $2 / 1e6, $6 / 1e6, $3 / 1e6, $7 / 1e6, $4, $8, $5, $9,
+	    ($2 > 0 ? $6 / $2 : 0)
+}'
+rm -f "${TMPDIR:-/tmp}/compare.$$.old" "${TMPDIR:-/tmp}/compare.$$.new"
@@ -0,0 +1,289 @@
+/*gentree.c - reproducible synthetic trees for the benchmarks*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * usage: gentree [-s seed] shape count dir
+ *
+ *	flat	count entries in dir, plain files of varied size and mtime
+ *	deep	a chain of count nested dirs, a file in each
+ *	wide	count entries spread over a tree fanning out WIDE_FANOUT ways
+ *	mixed	count entries: files, executables, symlinks (some dangling),
+ *		fifos and a few subdirs with files of their own
+ *	names	count files with long, utf-8 and non-printable names
+ *
+ * Same seed, shape and count give the same tree: names, sizes, modes
+ * and times all come from one xorshift generator. Sizes are set with
+ * ftruncate, so big trees cost inodes, not disk blocks.
+ */
+
+#define WIDE_FANOUT	32
+/*mtimes are spread over the year before this, some in the future*/
+#define TIME_BASE	1700000000
+#define TIME_SPREAD	(400 * 24 * 60 * 60)
+
+static uint64_t rng_state;
+
+static uint64_t rng(void);
+static void make_file(int dfd, const char *name, mode_t mode);
+static void make_name(char *buf, size_t len, uint64_t i);
+static void gen_flat(int dfd, uint64_t count);
+static void gen_deep(int dfd, uint64_t count);
+static uint64_t gen_wide(int dfd, uint64_t count);
+static void gen_mixed(int dfd, uint64_t count);
+static void gen_names(int dfd, uint64_t count);
+static int make_dir(int dfd, const char *name);
+static void usage(void);
+
+int main(int argc, char *argv[]) {
+	const char *shape;
+	char *ep;
+	uint64_t count;
+	uint64_t seed;
+	int dfd;
+	int ch;
+
+	seed = 1;
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+		case 's':
+			seed = strtoull(optarg, &ep, 10);
+			if (*ep != '\0' || seed == 0) {
+				errx(1, "invalid seed: %s", optarg);
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 3) {
+		usage();
+	}
+	shape = argv[0];
+	errno = 0;
+	count = strtoull(argv[1], &ep, 10);
+	if (errno != 0 || *ep != '\0' || count == 0) {
+		errx(1, "invalid count: %s", argv[1]);
+	}
+	rng_state = seed;
+
+	if (mkdir(argv[2], 0755) < 0 && errno != EEXIST) {
+		err(1, "%s", argv[2]);
+	}
+	if ((dfd = open(argv[2], O_RDONLY | O_DIRECTORY)) < 0) {
+		err(1, "%s", argv[2]);
+	}
+	if (strcmp(shape, "flat") == 0) {
+		gen_flat(dfd, count);
+	} else if (strcmp(shape, "deep") == 0) {
+		gen_deep(dfd, count);
+	} else if (strcmp(shape, "wide") == 0) {
+		(void)gen_wide(dfd, count);
+	} else if (strcmp(shape, "mixed") == 0) {
+		gen_mixed(dfd, count);
+	} else if (strcmp(shape, "names") == 0) {
+		gen_names(dfd, count);
+	} else {
+		usage();
+	}
+	(void)close(dfd);
+	return 0;
+}
+
+/*xorshift64*/
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/*file of random size and mtime*/
+static void make_file(int dfd, const char *name, mode_t mode) {
+	struct timespec ts[2];
+	int fd;
+
+	if ((fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0) {
+		err(1, "%s", name);
+	}
+	/*mostly small, now and then large*/
+	if (ftruncate(fd, (off_t)(rng() % 8 == 0 ? rng() % (64 << 20) : rng() % 16384)) < 0) {
+		err(1, "%s", name);
+	}
+	ts[0].tv_sec = ts[1].tv_sec = TIME_BASE - TIME_SPREAD + (time_t)(rng() % (TIME_SPREAD + 86400));
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	if (futimens(fd, ts) < 0) {
+		err(1, "%s", name);
+	}
+	(void)close(fd);
+}
+
+/*dir name in dfd, opened. existing dirs are reused*/
+static int make_dir(int dfd, const char *name) {
+	int fd;
+
+	if (mkdirat(dfd, name, 0755) < 0 && errno != EEXIST) {
+		err(1, "%s", name);
+	}
+	if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) < 0) {
+		err(1, "%s", name);
+	}
+	return fd;
+}
+
+/*unique name for entry i, random prefix so read and sort order differ*/
+static void make_name(char *buf, size_t len, uint64_t i) {
+	static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789_-.";
+	size_t n;
+	size_t j;
+
+	n = 1 + rng() % 12;
+	for (j = 0; j < n && j < len - 1; j++) {
+		/*no leading dot, hidden files are a separate question*/
+		buf[j] = alpha[rng() % (sizeof(alpha) - (j == 0 ? 2 : 1))];
+	}
+	(void)snprintf(buf + j, len - j, "_%llu", (unsigned long long)i);
+}
+
+static void gen_flat(int dfd, uint64_t count) {
+	char name[64];
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		make_name(name, sizeof(name), i);
+		make_file(dfd, name, 0644);
+	}
+}
+
+static void gen_deep(int dfd, uint64_t count) {
+	uint64_t i;
+	int fd;
+
+	dfd = dup(dfd);
+	for (i = 0; i < count; i++) {
+		make_file(dfd, "file", 0644);
+		fd = make_dir(dfd, "d");
+		(void)close(dfd);
+		dfd = fd;
+	}
+	(void)close(dfd);
+}
+
+/*count entries below dfd, WIDE_FANOUT per dir. returns entries made*/
+static uint64_t gen_wide(int dfd, uint64_t count) {
+	char name[32];
+	uint64_t made;
+	uint64_t share;
+	int i;
+	int fd;
+
+	if (count <= WIDE_FANOUT) {
+		for (made = 0; made < count; made++) {
+			(void)snprintf(name, sizeof(name), "f%llu", (unsigned long long)made);
+			make_file(dfd, name, 0644);
+		}
+		return made;
+	}
+	/*each subdir is an entry itself, the rest is split evenly*/
+	made = 0;
+	for (i = 0; i < WIDE_FANOUT && made < count; i++) {
+		share = (count - WIDE_FANOUT) / WIDE_FANOUT;
+		(void)snprintf(name, sizeof(name), "d%d", i);
+		fd = make_dir(dfd, name);
+		made += 1 + gen_wide(fd, share > 0 ? share : 1);
+		(void)close(fd);
+	}
+	return made;
+}
+
+static void gen_mixed(int dfd, uint64_t count) {
+	char name[64];
+	char target[64];
+	char last[64];
+	uint64_t i;
+	int fd;
+	int r;
+
+	last[0] = '\0';
+	for (i = 0; i < count; i++) {
+		make_name(name, sizeof(name), i);
+		r = (int)(rng() % 100);
+		if (r < 55) {
+			make_file(dfd, name, 0644);
+			(void)memcpy(last, name, sizeof(last));
+		} else if (r < 70) {
+			make_file(dfd, name, 0755);
+		} else if (r < 85) {
+			/*to the last plain file, every fifth one nowhere*/
+			if (rng() % 5 == 0 || last[0] == '\0') {
+				(void)snprintf(target, sizeof(target), "missing_%llu",
+				    (unsigned long long)i);
+			} else {
+				(void)memcpy(target, last, sizeof(target));
+			}
+			if (symlinkat(target, dfd, name) < 0) {
+				err(1, "%s", name);
+			}
+		} else if (r < 95) {
+			if (mkfifoat(dfd, name, 0644) < 0) {
+				err(1, "%s", name);
+			}
+		} else {
+			fd = make_dir(dfd, name);
+			make_file(fd, "inner", 0644);
+			(void)close(fd);
+		}
+	}
+}
+
+static void gen_names(int dfd, uint64_t count) {
+	/*utf-8, then bytes a terminal shows as garbage or acts on*/
+	static const char *const pieces[] = {
+		"\xc3\xa9t\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac", "\x01", "\t", "\n",
+		"\x1b[31m", "\x7f", "\xff\xfe", " ", "plain", "long_component_",
+	};
+	char name[NAME_MAX + 1];
+	char num[32];
+	size_t len;
+	size_t max;
+	size_t n;
+	uint64_t i;
+	const char *p;
+
+	for (i = 0; i < count; i++) {
+		/*a third are near NAME_MAX, the rest short*/
+		max = rng() % 3 == 0 ? NAME_MAX - 24 : 8 + rng() % 40;
+		len = 0;
+		while (len < max) {
+			p = pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+			n = strlen(p);
+			if (len + n > max) {
+				break;
+			}
+			(void)memcpy(name + len, p, n);
+			len += n;
+		}
+		(void)snprintf(num, sizeof(num), "_%llu", (unsigned long long)i);
+		(void)memcpy(name + len, num, strlen(num) + 1);
+		make_file(dfd, name, 0644);
+	}
+}
+
+static void usage(void) {
+	(void)fprintf(stderr, "usage: gentree [-s seed] flat|deep|wide|mixed|names count dir\n");
+	exit(1);
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+# run.sh - benchmark ls over synthetic trees, one json line per run
+#
+# usage: bench/run.sh [-r runs] [-s sizes] [-o file] [tree ...]
+#
+# trees are made once by bench/gentree under $BENCH_DIR and reused.
+# sizes picks the flat trees, default "10k 1m"; add 10m for the big one.
+# tree names: flat-10k flat-1m flat-10m deep wide mixed names, default all.
+# results go to bench/results/<commit>.jsonl unless -o says otherwise;
+# bench/compare.sh diffs two of those.
+
+LS=${LS:-./ls}
+GENTREE=${GENTREE:-bench/gentree}
+BENCHRUN=${BENCHRUN:-bench/benchrun}
+BENCH_DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/ls-bench}
+RUNS=5
+SIZES="10k 1m"
+OUT=
+
+# the flag sets every tree is listed with
+FLAGSETS="-l -R -lR -t -S -f -F -i"
+
+while getopts r:s:o: ch; do
+	case $ch in
+	r) RUNS=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	*) echo "usage: $0 [-r runs] [-s sizes] [-o file] [tree ...]" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+for p in "$LS" "$GENTREE" "$BENCHRUN"; do
+	if [ ! -x "$p" ]; then
+		echo "$0: $p not built, try make bench" >&2
+		exit 1
+	fi
+done
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ -n "$(git status --porcelain --untracked-files=no 2>/dev/null)" ]; then
+	COMMIT=$COMMIT-dirty
+fi
+if [ -z "$OUT" ]; then
+	mkdir -p bench/results || exit 1
+	OUT=bench/results/$COMMIT.jsonl
+fi
+
+TREES=$*
+if [ -z "$TREES" ]; then
+	for s in $SIZES; do
+		TREES="$TREES flat-$s"
+	done
+	TREES="$TREES deep wide mixed names"
+fi
+
+# shape and entry count for a tree name
+spec() {
+	case $1 in
+	flat-10k) echo flat 10000 ;;
+	flat-1m) echo flat 1000000 ;;
+	flat-10m) echo flat 10000000 ;;
+	deep) echo deep 2000 ;;
+	wide) echo wide 200000 ;;
+	mixed) echo mixed 100000 ;;
+	names) echo names 20000 ;;
+	*) return 1 ;;
+	esac
+}
+
+# make the tree unless a finished one with the same spec is there
+tree() {
+	dir=$BENCH_DIR/$1
+	if [ "$(cat "$dir.spec" 2>/dev/null)" = "$2" ]; then
+		return 0
+	fi
+	echo "generating $1 ($2)" >&2
+	rm -rf "$dir" "$dir.spec"
+	mkdir -p "$BENCH_DIR" || exit 1
+	# shellcheck disable=SC2086
+	"$GENTREE" $2 "$dir" || exit 1
+	echo "$2" > "$dir.spec"
+}
+
+for t in $TREES; do
+	if ! s=$(spec "$t"); then
+		echo "$0: unknown tree $t" >&2
+		exit 1
+	fi
+	tree "$t" "$s"
+	for f in $FLAGSETS; do
+		echo "$t $f" >&2
+		"$BENCHRUN" -r "$RUNS" -c "$COMMIT" -t "$t" -n "$t$f" -f "$f" \
+		    "$LS" "$f" "$BENCH_DIR/$t" >> "$OUT" || exit 1
+	done
+done
+echo "results in $OUT" >&2
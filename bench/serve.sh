@@ -0,0 +1,84 @@
+#!/bin/sh
+# serve.sh - ls as a fresh process against requests to ls --serve
+#
+# usage: bench/serve.sh [-n requests] [-c clients] [-o file] [tree ...]
+#
+# every tree (flat-100 mixed-1k flat-10k, default the first two) is
+# made by bench/gentree under $BENCH_DIR and listed with each flag set
+# three ways: ls exec'd every time, ls --client exec'd every time, and
+# straight over the socket with no process at all. one json line per run
+# from bench/servebench, to bench/results/<commit>-serve.jsonl unless -o says otherwise.
+
+LS=${LS:-./ls}
+GENTREE=${GENTREE:-bench/gentree}
+SERVEBENCH=${SERVEBENCH:-bench/servebench}
+BENCH_DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/ls-bench}
+REQUESTS=2000
+CLIENTS=4
+OUT=
+
+# small listings, where starting up is most of the cost
+FLAGSETS="-l -1 -lR"
+
+while getopts n:c:o: ch; do
+	case $ch in
+	n) REQUESTS=$OPTARG ;;
+	c) CLIENTS=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	*) echo "usage: $0 [-n requests] [-c clients] [-o file] [tree ...]" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+for p in "$LS" "$GENTREE" "$SERVEBENCH"; do
+	if [ ! -x "$p" ]; then
+		echo "$0: $p not built, try make bench" >&2
+		exit 1
+	fi
+done
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ -z "$OUT" ]; then
+	mkdir -p bench/results || exit 1
+	OUT=bench/results/$COMMIT-serve.jsonl
+fi
+TREES=${*:-flat-100 mixed-1k}
+
+SOCK=${TMPDIR:-/tmp}/ls-serve.$$
+"$LS" --serve "$SOCK" &
+PID=$!
+trap 'kill $PID 2>/dev/null' EXIT INT TERM
+# wait for the socket
+i=0
+while [ ! -S "$SOCK" ] && [ "$i" -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+for t in $TREES; do
+	case $t in
+	flat-100) s="flat 100" ;;
+	mixed-1k) s="mixed 1000" ;;
+	flat-10k) s="flat 10000" ;;
+	*) echo "$0: unknown tree $t" >&2; exit 1 ;;
+	esac
+	dir=$BENCH_DIR/$t
+	if [ "$(cat "$dir.spec" 2>/dev/null)" != "$s" ]; then
+		echo "generating $t ($s)" >&2
+		rm -rf "$dir" "$dir.spec"
+		mkdir -p "$BENCH_DIR" || exit 1
+		# shellcheck disable=SC2086
+		"$GENTREE" $s "$dir" || exit 1
+		echo "$s" > "$dir.spec"
+	fi
+	for f in $FLAGSETS; do
+		echo "$t $f" >&2
+		"$SERVEBENCH" -m exec -n "$REQUESTS" -c "$CLIENTS" -l "$t$f" \
+		    "$LS" "$f" "$dir" >> "$OUT" || exit 1
+		"$SERVEBENCH" -m exec -n "$REQUESTS" -c "$CLIENTS" -l "$t$f client" \
+		    "$LS" --client "$SOCK" "$f" "$dir" >> "$OUT" || exit 1
+		"$SERVEBENCH" -m socket -s "$SOCK" -n "$REQUESTS" -c "$CLIENTS" -l "$t$f" \
+		    ls "$f" "$dir" >> "$OUT" || exit 1
+	done
+done
+echo "results in $OUT" >&2
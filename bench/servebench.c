@@ -0,0 +1,303 @@
+/*servebench.c - request throughput and latency, ls --serve against exec*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * usage: servebench [-m exec | socket] [-n requests] [-c clients]
+ *	    [-s socket] [-l label] command [arg ...]
+ *
+ * Runs requests listings from clients threads at once, each thread one
+ * after another, and prints
+ *
+ *	{"label":"..","mode":"..","requests":..,"clients":..,"wall_ns":..,
+ *	 "rps":..,"p50_ns":..,"p90_ns":..,"p99_ns":..,"max_ns":..}
+ *
+ * exec forks and execs the command for each, stdout on /dev/null, as a
+ * script calling ls would; give it ls --client socket ... to time the
+ * client too. socket sends the command's argv to the ls --serve at
+ * socket itself, the way a program that keeps a daemon around would,
+ * so no process is started at all. Latency is from fork or connect to
+ * wait or reply.
+ */
+
+/*as in serve.c*/
+#define SERVE_MAGIC	0x6c736431u
+#define SERVE_NFDS	3
+
+struct serve_request {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t len;
+};
+
+struct serve_reply {
+	int32_t status;
+	int32_t sig;
+};
+
+struct client {
+	pthread_t thread;
+	int n;
+	int64_t *lat;
+};
+
+static bool use_socket;
+static char **cmd;
+static int ncmd;
+static struct sockaddr_un addr;
+static int devnull;
+static int cwd;
+static char *args;
+static size_t args_len;
+
+static void *client_main(void *arg);
+static bool run_exec(void);
+static bool run_socket(void);
+static int cmp_ns(const void *a, const void *b);
+static int64_t now_ns(void);
+static void usage(void);
+
+int main(int argc, char *argv[]) {
+	struct client *clients;
+	const char *label = "";
+	const char *sock = NULL;
+	int64_t *lat;
+	int64_t t0;
+	int64_t wall;
+	size_t off;
+	char *ep;
+	int requests;
+	int nclients;
+	int ch;
+	int i;
+
+	requests = 1000;
+	nclients = 1;
+	while ((ch = getopt(argc, argv, "+m:n:c:s:l:")) != -1) {
+		switch (ch) {
+		case 'm':
+			if (strcmp(optarg, "socket") == 0) {
+				use_socket = true;
+			} else if (strcmp(optarg, "exec") != 0) {
+				usage();
+			}
+			break;
+		case 'n':
+			requests = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || requests < 1) {
+				errx(1, "invalid requests: %s", optarg);
+			}
+			break;
+		case 'c':
+			nclients = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || nclients < 1 || nclients > 1024) {
+				errx(1, "invalid clients: %s", optarg);
+			}
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	cmd = argv + optind;
+	ncmd = argc - optind;
+	if (ncmd < 1 || (use_socket && sock == NULL)) {
+		usage();
+	}
+	if (nclients > requests) {
+		nclients = requests;
+	}
+
+	if ((devnull = open("/dev/null", O_WRONLY)) < 0) {
+		err(1, "/dev/null");
+	}
+	if (use_socket) {
+		if (strlen(sock) >= sizeof(addr.sun_path)) {
+			errx(1, "%s: socket path too long", sock);
+		}
+		addr.sun_family = AF_UNIX;
+		(void)memcpy(addr.sun_path, sock, strlen(sock) + 1);
+		if ((cwd = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+			err(1, ".");
+		}
+		/*argv, then TZ as ls --client sends it*/
+		args_len = getenv("TZ") != NULL ? strlen(getenv("TZ")) + 2 : 1;
+		for (i = 0; i < ncmd; i++) {
+			args_len += strlen(cmd[i]) + 1;
+		}
+		if ((args = malloc(args_len)) == NULL) {
+			err(1, NULL);
+		}
+		off = 0;
+		for (i = 0; i < ncmd; i++) {
+			(void)memcpy(args + off, cmd[i], strlen(cmd[i]) + 1);
+			off += strlen(cmd[i]) + 1;
+		}
+		args[off] = '\0';
+		if (getenv("TZ") != NULL) {
+			args[off] = '=';
+			(void)memcpy(args + off + 1, getenv("TZ"), strlen(getenv("TZ")) + 1);
+		}
+	}
+
+	if ((clients = calloc(nclients, sizeof(struct client))) == NULL ||
+	    (lat = malloc(requests * sizeof(int64_t))) == NULL) {
+		err(1, NULL);
+	}
+	t0 = now_ns();
+	off = 0;
+	for (i = 0; i < nclients; i++) {
+		clients[i].n = requests / nclients + (i < requests % nclients);
+		clients[i].lat = lat + off;
+		off += clients[i].n;
+		if ((errno = pthread_create(&clients[i].thread, NULL, client_main, &clients[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+	wall = now_ns() - t0;
+
+	qsort(lat, requests, sizeof(int64_t), cmp_ns);
+	(void)printf("{\"label\":\"%s\",\"mode\":\"%s\",\"requests\":%d,\"clients\":%d,"
+	    "\"wall_ns\":%lld,\"rps\":%.1f,\"p50_ns\":%lld,\"p90_ns\":%lld,"
+	    "\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+	    label, use_socket ? "socket" : "exec", requests, nclients, (long long)wall,
+	    requests * 1e9 / (double)wall, (long long)lat[requests / 2],
+	    (long long)lat[requests * 9 / 10], (long long)lat[requests * 99 / 100],
+	    (long long)lat[requests - 1]);
+	return 0;
+}
+
+/*one client: its share of the requests, back to back*/
+static void *client_main(void *arg) {
+	struct client *c = arg;
+	int64_t t;
+	int i;
+
+	for (i = 0; i < c->n; i++) {
+		t = now_ns();
+		if (!(use_socket ? run_socket() : run_exec())) {
+			errx(1, "request failed");
+		}
+		c->lat[i] = now_ns() - t;
+	}
+	return NULL;
+}
+
+static bool run_exec(void) {
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (dup2(devnull, STDOUT_FILENO) < 0) {
+			_exit(127);
+		}
+		execvp(cmd[0], cmd);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			err(1, "waitpid");
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*one request as ls --client makes it, stdout on /dev/null*/
+static bool run_socket(void) {
+	struct serve_request req;
+	struct serve_reply rep;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		char buf[CMSG_SPACE(SERVE_NFDS * sizeof(int))];
+		struct cmsghdr align;
+	} cb;
+	int fds[SERVE_NFDS];
+	size_t got;
+	ssize_t n;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		err(1, "socket");
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err(1, "%s", addr.sun_path);
+	}
+	fds[0] = cwd;
+	fds[1] = devnull;
+	fds[2] = STDERR_FILENO;
+	req.magic = SERVE_MAGIC;
+	req.argc = (uint32_t)ncmd;
+	req.len = (uint32_t)args_len;
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	(void)memset(&mh, 0, sizeof(mh));
+	(void)memset(&cb, 0, sizeof(cb));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.buf;
+	mh.msg_controllen = sizeof(cb.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(SERVE_NFDS * sizeof(int));
+	(void)memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(fd, &mh, 0) != (ssize_t)sizeof(req) ||
+	    write(fd, args, args_len) != (ssize_t)args_len) {
+		err(1, "send");
+	}
+	for (got = 0; got < sizeof(rep); got += (size_t)n) {
+		if ((n = read(fd, (char *)&rep + got, sizeof(rep) - got)) <= 0) {
+			errx(1, "no reply");
+		}
+	}
+	(void)close(fd);
+	return rep.status == 0 && rep.sig == 0;
+}
+
+static int cmp_ns(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(void) {
+	(void)fprintf(stderr, "usage: servebench [-m exec | socket] [-n requests] [-c clients] "
+	    "[-s socket] [-l label] command [arg ...]\n");
+	exit(1);
+}
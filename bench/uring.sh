@@ -0,0 +1,59 @@
+#!/bin/sh
+# uring.sh - compare synchronous and io_uring stat paths on one huge dir
+#
+# usage: bench/uring.sh [-n entries] [-r runs] [dir]
+# dir defaults to a fresh directory under $TMPDIR and is reused if it
+# already holds the requested number of entries.
+
+LS=${LS:-./ls}
+N=1000000
+RUNS=3
+
+while getopts n:r: ch; do
+	case $ch in
+	n) N=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	*) echo "usage: $0 [-n entries] [-r runs] [dir]" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+DIR=${1:-${TMPDIR:-/tmp}/ls-bench-flat-$N}
+
+if [ ! -x "$LS" ]; then
+	echo "$0: $LS not built" >&2
+	exit 1
+fi
+
+mkdir -p "$DIR" || exit 1
+have=$(find "$DIR" -mindepth 1 -maxdepth 1 | wc -l)
+if [ "$have" -ne "$N" ]; then
+	echo "creating $N entries in $DIR" >&2
+	find "$DIR" -mindepth 1 -delete
+	(cd "$DIR" && seq -f 'f%.0f' 1 "$N" | xargs touch)
+fi
+
+# -f keeps sort out of the picture, -l needs a full stat per entry
+run() {
+	label=$1
+	shift
+	i=0
+	while [ "$i" -lt "$RUNS" ]; do
+		if [ -x /usr/bin/time ]; then
+			/usr/bin/time -f "$label %e s real %U s user %S s sys %M KB" \
+			    "$LS" "$@" "$DIR" >/dev/null
+		else
+			# no time(1), wall clock only
+			t0=$(date +%s%N)
+			"$LS" "$@" "$DIR" >/dev/null
+			t1=$(date +%s%N)
+			echo "$label $(( (t1 - t0) / 1000000 )) ms real" >&2
+		fi
+		i=$((i + 1))
+	done
+}
+
+echo "$N entries, $RUNS runs each, cold cache not forced" >&2
+run sync -fl
+run uring -fl --uring
+run sync-nosync -fl --no-sync
+run uring-nosync -fl --uring --no-sync
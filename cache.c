@@ -0,0 +1,337 @@
+/*cache.c - --cache, sorted listings kept on disk between runs*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+/*
+ * One file per directory and option set, named after st_dev, st_ino
+ * and a signature of the options that change what a listing holds.
+ * It has the sorted entries as they came out of read_directory_at:
+ * a header, an array of cache_entry and a pool of nul terminated
+ * names and link targets. A hit maps the file and points the entries
+ * into it, no readdir and no stat.
+ *
+ * The header also has the directory's mtime and ctime; any create,
+ * delete or rename in it changes both, so a listing only comes back
+ * for the directory it was made from. Changes inside the entries
+ * (a file growing, a chmod) do not touch the directory, so -l fields
+ * can be as old as the cache file. That is the deal --cache offers.
+ *
+ * Writers never touch a file in place: a new one is written under a
+ * temporary name and renamed over the old, so a reader maps either
+ * the old file or the new one whole. Nothing is stored if the
+ * directory changed while it was read, or in the last CACHE_SETTLE
+ * seconds, where a change in the same timestamp tick would go unseen.
+ * Readers check size, bounds and a checksum before trusting a file,
+ * so a torn or foreign one is just a miss.
+ */
+
+#define CACHE_MAGIC	"lscache\0"
+#define CACHE_VERSION	1
+#define CACHE_SETTLE	2
+/*no link target*/
+#define CACHE_NONE	UINT32_MAX
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;	/* sizeof(struct cache_entry), a layout check */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint64_t sig;
+	uint64_t count;
+	uint64_t total_blocks;
+	uint64_t total_size;
+	uint64_t pool_len;	/* padded to 8 */
+	uint64_t sum;		/* of everything after the header */
+};
+
+struct cache_entry {
+	struct entry_meta m;
+	uint32_t name;		/* offsets into the pool */
+	uint32_t link;
+};
+
+static const char *cache_dir;
+
+static void cache_path(char *buf, size_t len, const struct cache_key *key);
+static uint64_t cache_sum(const char *p, size_t len);
+
+/*use dir for --cache, made if missing. false if it cant be used*/
+bool cache_init(const char *dir){
+	struct stat st;
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		warn("%s", dir);
+		return false;
+	}
+	if (stat(dir, &st) < 0) {
+		warn("%s", dir);
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		warnx("%s: not a directory", dir);
+		return false;
+	}
+	cache_dir = dir;
+	return true;
+}
+
+/*the key of the dir open on fd, for listings made with opts and mp.
+valid is false if the dir may still be changing*/
+bool cache_key_at(int fd, const struct options *opts, const struct meta_plan *mp,
+    struct cache_key *key){
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		return false;
+	}
+	key->dev = (uint64_t)st.st_dev;
+	key->ino = (uint64_t)st.st_ino;
+	key->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+	key->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+	key->ctime_sec = (int64_t)st.st_ctim.tv_sec;
+	key->ctime_nsec = (int64_t)st.st_ctim.tv_nsec;
+	/*what gets listed, which fields and in what order*/
+	key->sig = (uint64_t)mp->need | (uint64_t)mp->mask << 8 |
+	    (uint64_t)mp->time_kind << 40 |
+	    (uint64_t)opts->show_all << 42 | (uint64_t)opts->show_almost_all << 43 |
+	    (uint64_t)opts->unsorted << 44 | (uint64_t)opts->sort_size << 45 |
+	    (uint64_t)opts->sort_time << 46 | (uint64_t)opts->reverse << 47 |
+	    (uint64_t)wants_link(opts) << 48;
+	/*globs, and with includes -R/--du keep dirs that match none*/
+	if (opts->filter != NULL) {
+		key->sig ^= filter_sig(opts->filter) ^
+		    (uint64_t)(opts->recursive || opts->du) << 49;
+	}
+	key->settled = time(NULL) - CACHE_SETTLE > st.st_mtim.tv_sec &&
+	    time(NULL) - CACHE_SETTLE > st.st_ctim.tv_sec;
+	return true;
+}
+
+/*true if the dir on fd still has key, so what was read from it is current*/
+bool cache_key_same(int fd, const struct cache_key *key){
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		return false;
+	}
+	return (uint64_t)st.st_dev == key->dev && (uint64_t)st.st_ino == key->ino &&
+	    (int64_t)st.st_mtim.tv_sec == key->mtime_sec &&
+	    (int64_t)st.st_mtim.tv_nsec == key->mtime_nsec &&
+	    (int64_t)st.st_ctim.tv_sec == key->ctime_sec &&
+	    (int64_t)st.st_ctim.tv_nsec == key->ctime_nsec;
+}
+
+/*fill dl from the cache file for key. false on any miss*/
+bool cache_load(const struct cache_key *key, struct dir_listing *dl){
+	char path[PATH_MAX];
+	const struct cache_header *h;
+	const struct cache_entry *ce;
+	const char *pool;
+	struct file_entry *files;
+	struct stat st;
+	size_t len;
+	void *map;
+	uint64_t i;
+	int fd;
+
+	cache_path(path, sizeof(path), key);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cache_header)) {
+		(void)close(fd);
+		return false;
+	}
+	len = (size_t)st.st_size;
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	/*trust nothing until it all adds up*/
+	h = map;
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != CACHE_VERSION || h->entry_size != sizeof(struct cache_entry) ||
+	    h->dev != key->dev || h->ino != key->ino || h->sig != key->sig ||
+	    h->mtime_sec != key->mtime_sec || h->mtime_nsec != key->mtime_nsec ||
+	    h->ctime_sec != key->ctime_sec || h->ctime_nsec != key->ctime_nsec ||
+	    h->count > INT_MAX ||
+	    h->count > (len - sizeof(*h)) / sizeof(struct cache_entry) ||
+	    h->pool_len == 0 ||
+	    h->pool_len != len - sizeof(*h) - h->count * sizeof(struct cache_entry) ||
+	    h->sum != cache_sum((const char *)map + sizeof(*h), len - sizeof(*h))) {
+		(void)munmap(map, len);
+		return false;
+	}
+	ce = (const struct cache_entry *)((const char *)map + sizeof(*h));
+	pool = (const char *)(ce + h->count);
+	/*the pool ends in a nul, so any offset in it is a whole string*/
+	if (pool[h->pool_len - 1] != '\0') {
+		(void)munmap(map, len);
+		return false;
+	}
+
+	files = NULL;
+	if (h->count > 0 && (files = lib_malloc(h->count * sizeof(struct file_entry))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < h->count; i++) {
+		if (ce[i].name >= h->pool_len ||
+		    (ce[i].link != CACHE_NONE && ce[i].link >= h->pool_len)) {
+			lib_free(files);
+			(void)munmap(map, len);
+			return false;
+		}
+		files[i].name = (char *)(uintptr_t)(pool + ce[i].name);
+		files[i].link = ce[i].link == CACHE_NONE ? NULL :
+		    (char *)(uintptr_t)(pool + ce[i].link);
+		files[i].m = ce[i].m;
+	}
+	dl->files = files;
+	dl->count = (int)h->count;
+	dl->total_blocks = h->total_blocks;
+	dl->total_size_bytes = h->total_size;
+	dl->map = map;
+	dl->map_len = len;
+	return true;
+}
+
+/*write dl as the cache file for key, quietly giving up on errors*/
+void cache_store(const struct cache_key *key, const struct dir_listing *dl){
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	struct cache_header *h;
+	struct cache_entry *ce;
+	char *buf;
+	char *pool;
+	size_t pool_len;
+	size_t off;
+	size_t len;
+	size_t n;
+	ssize_t w;
+	int fd;
+	int i;
+
+	pool_len = 0;
+	for (i = 0; i < dl->count; i++) {
+		pool_len += strlen(dl->files[i].name) + 1;
+		if (dl->files[i].link != NULL) {
+			pool_len += strlen(dl->files[i].link) + 1;
+		}
+	}
+	/*at least one nul, and whole words for cache_sum*/
+	pool_len = (pool_len + 8) & ~(size_t)7;
+	if (pool_len > CACHE_NONE) {
+		return;
+	}
+	len = sizeof(*h) + (size_t)dl->count * sizeof(struct cache_entry) + pool_len;
+	if ((buf = calloc(1, len)) == NULL) {
+		err(1, NULL);
+	}
+	h = (struct cache_header *)buf;
+	ce = (struct cache_entry *)(buf + sizeof(*h));
+	pool = (char *)(ce + dl->count);
+	off = 0;
+	for (i = 0; i < dl->count; i++) {
+		ce[i].m = dl->files[i].m;
+		ce[i].name = (uint32_t)off;
+		n = strlen(dl->files[i].name) + 1;
+		(void)memcpy(pool + off, dl->files[i].name, n);
+		off += n;
+		ce[i].link = CACHE_NONE;
+		if (dl->files[i].link != NULL) {
+			ce[i].link = (uint32_t)off;
+			n = strlen(dl->files[i].link) + 1;
+			(void)memcpy(pool + off, dl->files[i].link, n);
+			off += n;
+		}
+	}
+	(void)memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+	h->version = CACHE_VERSION;
+	h->entry_size = sizeof(struct cache_entry);
+	h->dev = key->dev;
+	h->ino = key->ino;
+	h->mtime_sec = key->mtime_sec;
+	h->mtime_nsec = key->mtime_nsec;
+	h->ctime_sec = key->ctime_sec;
+	h->ctime_nsec = key->ctime_nsec;
+	h->sig = key->sig;
+	h->count = (uint64_t)dl->count;
+	h->total_blocks = dl->total_blocks;
+	h->total_size = dl->total_size_bytes;
+	h->pool_len = pool_len;
+	h->sum = cache_sum(buf + sizeof(*h), len - sizeof(*h));
+
+	/*whole file under a temporary name, then into place*/
+	cache_path(path, sizeof(path), key);
+	(void)snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", cache_dir);
+	if ((fd = mkstemp(tmp)) < 0) {
+		free(buf);
+		return;
+	}
+	for (off = 0; off < len; off += (size_t)w) {
+		if ((w = write(fd, buf + off, len - off)) < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	free(buf);
+	if (close(fd) < 0 || off < len || rename(tmp, path) < 0) {
+		(void)unlink(tmp);
+	}
+}
+
+/*drop the mapping a cache hit left in dl*/
+void cache_release(struct dir_listing *dl){
+	if (dl->map != NULL) {
+		(void)munmap(dl->map, dl->map_len);
+		dl->map = NULL;
+		dl->map_len = 0;
+	}
+}
+
+static void cache_path(char *buf, size_t len, const struct cache_key *key){
+	(void)snprintf(buf, len, "%s/%llx-%llx-%llx", cache_dir,
+	    (unsigned long long)key->dev, (unsigned long long)key->ino,
+	    (unsigned long long)key->sig);
+}
+
+/*fnv-1a a word at a time, len is a multiple of 8 and p aligned*/
+static uint64_t cache_sum(const char *p, size_t len){
+	const uint64_t *w;
+	uint64_t h;
+	size_t i;
+
+	w = (const uint64_t *)(const void *)p;
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < len / 8; i++) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
@@ -0,0 +1,216 @@
+/*dents.c - directory reading straight from getdents64*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * readdir copies records out of a 32K buffer and ls then copied every
+ * name again. Here the kernel writes records into buffers that start
+ * at DENTS_MIN_BUF and grow 4x a call up to --getdents-buf (1M by
+ * default), so a huge dir takes a few syscalls, not thousands.
+ *
+ * With a keep arena the buffers are carved from it and never reused:
+ * a record's d_name is nul terminated, so entries point at it where it
+ * lies and the arena frees it with the listing. What a call did not
+ * fill goes back to the arena. Without one (streaming, --head/--tail,
+ * which copy what they keep) a single buffer is refilled.
+ *
+ * The -a/-A filter and --include/--exclude look at the raw name bytes
+ * before anything else sees the record, so a dropped name costs no
+ * stat and no copy. Records are handed out as struct dirent, which is
+ * laid out like linux_dirent64 on glibc and musl; where it is not, or
+ * there is no getdents64, this is readdir plus a copy.
+ */
+
+/*first buffer of a dir, most dirs fit*/
+#define DENTS_MIN_BUF	(32 * 1024)
+/*smallest leftover worth an end of dir probe, a few max size records*/
+#define DENTS_PROBE_MIN	(4 * 1024)
+
+struct dents_rec {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define DENTS_RAW	(offsetof(struct dirent, d_name) == offsetof(struct dents_rec, d_name) && \
+	offsetof(struct dirent, d_type) == offsetof(struct dents_rec, d_type) && \
+	sizeof(((struct dirent *)0)->d_ino) == sizeof(uint64_t))
+#else
+#define DENTS_RAW	0
+#endif
+
+static bool dents_fill(struct dents *d);
+static bool dents_listed(const struct dents *d, const char *name, unsigned char type);
+
+/*start reading the dir open on fd, which stays the caller's. names
+live as long as keep if given, else until the next dents_next*/
+bool dents_open(struct dents *d, int fd, struct arena *keep, const struct options *opts){
+	int dfd;
+
+	d->fd = fd;
+	d->keep = keep;
+	d->opts = opts;
+	d->buf = NULL;
+	d->size = 0;
+	d->len = 0;
+	d->pos = 0;
+	d->dir = NULL;
+	d->nread = 0;
+	d->error = 0;
+	if (DENTS_RAW) {
+		return true;
+	}
+	if ((dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		d->error = errno;
+		return false;
+	}
+	if ((d->dir = fdopendir(dfd)) == NULL) {
+		d->error = errno;
+		(void)close(dfd);
+		return false;
+	}
+	return true;
+}
+
+/*next entry -a/-A and the filter let through, NULL at the end or on errors (error set).
+good until the next call, see dents_name for longer*/
+struct dirent *dents_next(struct dents *d){
+	struct dents_rec *rec;
+	struct dirent *de;
+
+	if (d->dir != NULL) {
+		while ((de = readdir(d->dir)) != NULL) {
+			d->nread++;
+			if (!dents_listed(d, de->d_name, de->d_type)) {
+				continue;
+			}
+			return de;
+		}
+		return NULL;
+	}
+	for (;;) {
+		if (d->pos >= d->len && !dents_fill(d)) {
+			return NULL;
+		}
+		rec = (struct dents_rec *)(void *)(d->buf + d->pos);
+		d->pos += rec->d_reclen;
+		d->nread++;
+		if (dents_listed(d, rec->d_name, rec->d_type)) {
+			return (struct dirent *)(void *)rec;
+		}
+	}
+}
+
+/*name of de, from a reader with a keep arena, as long as the arena.
+no copy unless readdir is what is underneath, NULL if that fails*/
+char *dents_name(struct dents *d, struct dirent *de){
+	if (d->dir != NULL) {
+		return arena_strdup(d->keep, de->d_name);
+	}
+	return de->d_name;
+}
+
+void dents_close(struct dents *d){
+	if (d->dir != NULL) {
+		closedir(d->dir);
+		d->dir = NULL;
+	}
+	if (d->keep == NULL) {
+		lib_free(d->buf);
+	}
+	d->buf = NULL;
+}
+
+/*one getdents64 call. false at the end of the dir or on errors,
+ENOMEM among them*/
+static bool dents_fill(struct dents *d){
+#if defined(__linux__) && defined(SYS_getdents64)
+	size_t size;
+	long n;
+
+	/*start small, then grow for dirs that fill what they get*/
+	size = d->size == 0 ? DENTS_MIN_BUF : d->len > d->size / 2 ? d->size * 4 : d->size;
+	if (size > d->opts->getdents_buf) {
+		size = d->opts->getdents_buf;
+	}
+	if (d->keep != NULL) {
+		/*a short last call means the end is near, probe with what
+		the arena has left instead of a new chunk*/
+		if (d->size != 0 && d->len <= d->size / 2 && arena_avail(d->keep) >= DENTS_PROBE_MIN) {
+			size = arena_avail(d->keep) < size ? arena_avail(d->keep) : size;
+		}
+		d->buf = arena_alloc(d->keep, size);
+	} else if (size != d->size) {
+		lib_free(d->buf);
+		d->buf = lib_malloc(size);
+	}
+	if (d->buf == NULL) {
+		d->size = 0;
+		d->error = ENOMEM;
+		return false;
+	}
+	d->size = size;
+	d->pos = 0;
+	d->len = 0;
+	if ((n = syscall(SYS_getdents64, d->fd, d->buf, size)) < 0) {
+		d->error = errno;
+		n = 0;
+	}
+	d->len = (size_t)n;
+	if (d->keep != NULL) {
+		arena_trim(d->keep, d->buf, size, d->len);
+	}
+	return n > 0;
+#else
+	(void)d;
+	return false;
+#endif
+}
+
+/*is_listed_name on the raw bytes, . and .. without a strcmp, then
+the filter. only a name no --include matches may need a stat*/
+static bool dents_listed(const struct dents *d, const char *name, unsigned char type){
+	const struct options *opts = d->opts;
+	struct stat st;
+
+	if (name[0] == '.' && !opts->show_all && (!opts->show_almost_all ||
+	    name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+		return false;
+	}
+	if (opts->filter == NULL) {
+		return true;
+	}
+	switch (filter_name(opts->filter, name)) {
+	case FILTER_LIST:
+		return true;
+	case FILTER_DROP:
+		return false;
+	default:
+		/*kept for -R or --du to go into*/
+		if ((!opts->recursive && !opts->du) || (type != DT_DIR && type != DT_UNKNOWN)) {
+			return false;
+		}
+		return type == DT_DIR || (fstatat(d->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    S_ISDIR(st.st_mode));
+	}
+}
@@ -0,0 +1,164 @@
+/*du.c - --du subtree totals, hard links counted once*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ls.h"
+
+/*
+ * Every listing adds up its own entries with a single link as it is
+ * read, on whichever -j worker reads it, and keeps the (dev, ino) and
+ * sizes of the ones with more. The printer credits those in output
+ * order (du_credit), each to the first listing to show it, so which
+ * one gets a hard link is the same with or without -j. The seen set
+ * is only touched by the printer and needs no lock. The printer then
+ * sums the listings per subtree on its way back up.
+ *
+ * Entries have no st_dev of their own; they get the one of the dir
+ * they are in. Only directories can have another (mount points), and
+ * those are not hard links.
+ */
+
+/*slots to start with, grows at 3/4 full*/
+#define DU_INIT	1024
+
+struct du_slot {
+	uint64_t dev;
+	uint64_t ino;
+	bool used;
+};
+
+static struct du_slot *slots;
+static size_t size;
+static size_t used;
+
+static bool du_first_link(uint64_t dev, uint64_t ino);
+static uint64_t du_hash(uint64_t dev, uint64_t ino);
+static void du_grow(void);
+
+/*forget every link seen, for the next --du of a daemon*/
+void du_reset(void){
+	free(slots);
+	slots = NULL;
+	size = 0;
+	used = 0;
+}
+
+/*add up files, read from the dir open on fd, into dl->du, and keep
+the linked ones in dl->du_links for du_credit*/
+void du_count(int fd, const struct file_entry *files, int count, struct dir_listing *dl){
+	struct du_link *links;
+	struct stat st;
+	uint64_t dev;
+	size_t n;
+	int i;
+
+	dev = fstat(fd, &st) == 0 ? (uint64_t)st.st_dev : 0;
+	dl->du.blocks = 0;
+	dl->du.bytes = 0;
+	dl->du.entries = (uint64_t)count;
+	n = 0;
+	for (i = 0; i < count; i++) {
+		if (files[i].m.nlink > 1 && !S_ISDIR(files[i].m.mode)) {
+			n++;
+			continue;
+		}
+		dl->du.blocks += (uint64_t)files[i].m.blocks;
+		dl->du.bytes += (uint64_t)files[i].m.size;
+	}
+	if (n == 0) {
+		return;
+	}
+	if ((links = malloc(n * sizeof(struct du_link))) == NULL) {
+		err(1, NULL);
+	}
+	n = 0;
+	for (i = 0; i < count; i++) {
+		if (files[i].m.nlink > 1 && !S_ISDIR(files[i].m.mode)) {
+			links[n].dev = dev;
+			links[n].ino = files[i].m.ino;
+			links[n].blocks = (uint64_t)files[i].m.blocks;
+			links[n].bytes = (uint64_t)files[i].m.size;
+			n++;
+		}
+	}
+	free(dl->du_links);
+	dl->du_links = links;
+	dl->ndu_links = n;
+}
+
+/*add dl's hard links not seen in an earlier listing to dl->du.
+called by the printer, in output order*/
+void du_credit(struct dir_listing *dl){
+	size_t i;
+
+	for (i = 0; i < dl->ndu_links; i++) {
+		if (du_first_link(dl->du_links[i].dev, dl->du_links[i].ino)) {
+			dl->du.blocks += dl->du_links[i].blocks;
+			dl->du.bytes += dl->du_links[i].bytes;
+		}
+	}
+	free(dl->du_links);
+	dl->du_links = NULL;
+	dl->ndu_links = 0;
+}
+
+/*false if dev, ino was seen before*/
+static bool du_first_link(uint64_t dev, uint64_t ino){
+	size_t i;
+
+	if (used + 1 > size / 4 * 3) {
+		du_grow();
+	}
+	for (i = du_hash(dev, ino) & (size - 1); slots[i].used; i = (i + 1) & (size - 1)) {
+		if (slots[i].dev == dev && slots[i].ino == ino) {
+			return false;
+		}
+	}
+	slots[i].dev = dev;
+	slots[i].ino = ino;
+	slots[i].used = true;
+	used++;
+	return true;
+}
+
+/*splitmix64 finaliser over both*/
+static uint64_t du_hash(uint64_t dev, uint64_t ino){
+	uint64_t h;
+
+	h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/*double the table*/
+static void du_grow(void){
+	struct du_slot *old;
+	size_t old_size;
+	size_t i;
+	size_t j;
+
+	old = slots;
+	old_size = size;
+	size = old_size == 0 ? DU_INIT : old_size * 2;
+	if ((slots = calloc(size, sizeof(struct du_slot))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].used) {
+			continue;
+		}
+		for (j = du_hash(old[i].dev, old[i].ino) & (size - 1);
+		    slots[j].used; j = (j + 1) & (size - 1)) {
+			continue;
+		}
+		slots[j] = old[i];
+	}
+	free(old);
+}
@@ -0,0 +1,347 @@
+/*filter.c - --include/--exclude globs, matched on raw names*/
+
+#include <sys/types.h>
+
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * Patterns are compiled once, when the option is parsed, and then run
+ * on every name the readers see before it is stat'd or copied. Most
+ * globs are a literal with a * at one or both ends (*.log, core*,
+ * *tmp*), those are a length check and a memcmp or strstr. The rest
+ * become a bit-parallel NFA, a bit per glob token: each byte of the
+ * name is a shift, an or for the stars and an and with that byte's
+ * mask of tokens taking it, no backtracking. Globs with more tokens
+ * than bits, or [:classes:], go to fnmatch.
+ *
+ * Excludes drop what they match. If there are includes a name has to
+ * match one of them, except that with -R a dir is let through so the
+ * files under it can be reached; that is FILTER_DIR, the caller knows
+ * the type.
+ */
+
+#define PAT_EXACT	0
+#define PAT_PREFIX	1	/* lit* */
+#define PAT_SUFFIX	2	/* *lit */
+#define PAT_INFIX	3	/* *lit* */
+#define PAT_NFA		4
+#define PAT_FNMATCH	5
+
+/*tokens an NFA can hold, bit 0 is the start state*/
+#define PAT_MAX_TOKENS	63
+
+struct pattern {
+	int kind;
+	char *lit;		/* the literal for the fast kinds */
+	size_t len;
+	char *src;		/* for fnmatch */
+	uint64_t *accept;	/* [256], bit i+1 if token i takes the byte */
+	uint64_t stars;		/* bit i+1 if token i is a * */
+	uint64_t final;
+};
+
+struct filter {
+	struct pattern *inc;
+	int ninc;
+	struct pattern *exc;
+	int nexc;
+	uint64_t sig;
+};
+
+/*one glob token, a * or a set of bytes*/
+struct token {
+	bool star;
+	bool lit;		/* a single byte, c */
+	unsigned char c;
+	uint64_t set[4];
+};
+
+static bool pattern_compile(struct pattern *p, const char *glob);
+static void pattern_free(struct pattern *p);
+static int glob_tokens(const char *glob, struct token *tok, int max);
+static const char *glob_bracket(const char *s, struct token *t);
+static bool pattern_match(const struct pattern *p, const char *name, size_t len);
+static bool nfa_match(const struct pattern *p, const char *name);
+
+/*add glob to the --include or --exclude list of opts. false if out
+of memory*/
+bool filter_add(struct options *opts, const char *glob, bool include){
+	struct filter *f;
+	struct pattern *list;
+	int *n;
+	const char *s;
+
+	if ((f = opts->filter) == NULL) {
+		if ((f = lib_malloc(sizeof(*f))) == NULL) {
+			return false;
+		}
+		(void)memset(f, 0, sizeof(*f));
+		f->sig = 0xcbf29ce484222325ULL;
+		opts->filter = f;
+	}
+	list = include ? f->inc : f->exc;
+	n = include ? &f->ninc : &f->nexc;
+	if ((list = lib_realloc(list, (*n + 1) * sizeof(struct pattern))) == NULL) {
+		return false;
+	}
+	if (include) {
+		f->inc = list;
+	} else {
+		f->exc = list;
+	}
+	if (!pattern_compile(&list[*n], glob)) {
+		return false;
+	}
+	(*n)++;
+	/*fnv-1a over the kind and the glob, for the --cache key*/
+	f->sig = (f->sig ^ (include ? 'i' : 'e')) * 0x100000001b3ULL;
+	s = glob;
+	do {
+		f->sig = (f->sig ^ (unsigned char)*s) * 0x100000001b3ULL;
+	} while (*s++ != '\0');
+	return true;
+}
+
+/*free f and its patterns*/
+void filter_free(struct filter *f){
+	int i;
+
+	if (f == NULL) {
+		return;
+	}
+	for (i = 0; i < f->ninc; i++) {
+		pattern_free(&f->inc[i]);
+	}
+	for (i = 0; i < f->nexc; i++) {
+		pattern_free(&f->exc[i]);
+	}
+	lib_free(f->inc);
+	lib_free(f->exc);
+	lib_free(f);
+}
+
+/*what f says about name, FILTER_LIST, FILTER_DROP or FILTER_DIR*/
+int filter_name(const struct filter *f, const char *name){
+	size_t len;
+	int i;
+
+	len = strlen(name);
+	for (i = 0; i < f->nexc; i++) {
+		if (pattern_match(&f->exc[i], name, len)) {
+			return FILTER_DROP;
+		}
+	}
+	if (f->ninc == 0) {
+		return FILTER_LIST;
+	}
+	for (i = 0; i < f->ninc; i++) {
+		if (pattern_match(&f->inc[i], name, len)) {
+			return FILTER_LIST;
+		}
+	}
+	return FILTER_DIR;
+}
+
+/*the patterns of f, for --cache keys*/
+uint64_t filter_sig(const struct filter *f){
+	return f->sig;
+}
+
+/*false if out of memory, p holds nothing then*/
+static bool pattern_compile(struct pattern *p, const char *glob){
+	struct token tok[PAT_MAX_TOKENS + 1];
+	size_t len;
+	int ntok;
+	int first;
+	int last;
+	int i;
+	int b;
+
+	(void)memset(p, 0, sizeof(*p));
+	ntok = glob_tokens(glob, tok, PAT_MAX_TOKENS + 1);
+	if (ntok < 0 || ntok > PAT_MAX_TOKENS) {
+		p->kind = PAT_FNMATCH;
+		len = strlen(glob) + 1;
+		if ((p->src = lib_malloc(len)) == NULL) {
+			return false;
+		}
+		(void)memcpy(p->src, glob, len);
+		return true;
+	}
+
+	/*a run of single bytes with a * at either end or none*/
+	first = ntok > 0 && tok[0].star ? 1 : 0;
+	last = ntok > first && tok[ntok - 1].star ? ntok - 1 : ntok;
+	for (i = first; i < last && tok[i].lit; i++) {
+		continue;
+	}
+	if (i == last) {
+		p->kind = first == 0 ? (last == ntok ? PAT_EXACT : PAT_PREFIX) :
+		    (last == ntok ? PAT_SUFFIX : PAT_INFIX);
+		p->len = (size_t)(last - first);
+		if ((p->lit = lib_malloc(p->len + 1)) == NULL) {
+			return false;
+		}
+		for (i = first; i < last; i++) {
+			p->lit[i - first] = (char)tok[i].c;
+		}
+		p->lit[p->len] = '\0';
+		return true;
+	}
+
+	p->kind = PAT_NFA;
+	if ((p->accept = lib_malloc(256 * sizeof(uint64_t))) == NULL) {
+		return false;
+	}
+	(void)memset(p->accept, 0, 256 * sizeof(uint64_t));
+	for (i = 0; i < ntok; i++) {
+		if (tok[i].star) {
+			p->stars |= (uint64_t)1 << (i + 1);
+		}
+		for (b = 1; b < 256; b++) {
+			if (tok[i].star || (tok[i].set[b / 64] >> (b % 64) & 1) != 0) {
+				p->accept[b] |= (uint64_t)1 << (i + 1);
+			}
+		}
+	}
+	p->final = (uint64_t)1 << ntok;
+	return true;
+}
+
+static void pattern_free(struct pattern *p){
+	lib_free(p->lit);
+	lib_free(p->src);
+	lib_free(p->accept);
+}
+
+/*split glob into tok, runs of * as one. -1 if fnmatch should have it
+(a lone \ at the end is its call), max+1 if there are more than max*/
+static int glob_tokens(const char *glob, struct token *tok, int max){
+	const char *s;
+	struct token *t;
+	int n;
+
+	n = 0;
+	for (s = glob; *s != '\0'; ) {
+		if (*s == '*' && n > 0 && tok[n - 1].star) {
+			s++;
+			continue;
+		}
+		if (n == max) {
+			return max + 1;
+		}
+		t = &tok[n++];
+		(void)memset(t, 0, sizeof(*t));
+		if (*s == '*') {
+			t->star = true;
+			s++;
+		} else if (*s == '?') {
+			(void)memset(t->set, 0xff, sizeof(t->set));
+			s++;
+		} else if (*s == '[') {
+			if ((s = glob_bracket(s, t)) == NULL) {
+				return -1;
+			}
+		} else {
+			/*a plain byte, or \ and the byte it quotes*/
+			if (*s == '\\' && *++s == '\0') {
+				return -1;
+			}
+			t->lit = true;
+			t->c = (unsigned char)*s++;
+			t->set[t->c / 64] = (uint64_t)1 << (t->c % 64);
+		}
+	}
+	return n;
+}
+
+/*[...] at s into t, returns what follows. NULL for [:class:] and
+the like, and a [ with no ], where fnmatch has its own ideas*/
+static const char *glob_bracket(const char *s, struct token *t){
+	const char *p;
+	uint64_t set[4];
+	unsigned char lo;
+	unsigned char hi;
+	bool neg;
+	int c;
+
+	p = s + 1;
+	neg = *p == '!' || *p == '^';
+	if (neg) {
+		p++;
+	}
+	(void)memset(set, 0, sizeof(set));
+	/*a ] first is a member*/
+	do {
+		if (*p == '\0') {
+			return NULL;
+		}
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			return NULL;
+		}
+		if (*p == '\\' && p[1] != '\0') {
+			p++;
+		}
+		lo = (unsigned char)*p++;
+		hi = lo;
+		if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+			p++;
+			if (*p == '\\' && p[1] != '\0') {
+				p++;
+			}
+			hi = (unsigned char)*p++;
+		}
+		for (c = lo; c <= hi; c++) {
+			set[c / 64] |= (uint64_t)1 << (c % 64);
+		}
+	} while (*p != ']');
+	if (neg) {
+		set[0] = ~set[0];
+		set[1] = ~set[1];
+		set[2] = ~set[2];
+		set[3] = ~set[3];
+	}
+	(void)memcpy(t->set, set, sizeof(set));
+	return p + 1;
+}
+
+static bool pattern_match(const struct pattern *p, const char *name, size_t len){
+	switch (p->kind) {
+	case PAT_EXACT:
+		return len == p->len && memcmp(name, p->lit, len) == 0;
+	case PAT_PREFIX:
+		return len >= p->len && memcmp(name, p->lit, p->len) == 0;
+	case PAT_SUFFIX:
+		return len >= p->len && memcmp(name + len - p->len, p->lit, p->len) == 0;
+	case PAT_INFIX:
+		return strstr(name, p->lit) != NULL;
+	case PAT_NFA:
+		return nfa_match(p, name);
+	default:
+		return fnmatch(p->src, name, 0) == 0;
+	}
+}
+
+/*bit i+1 of d: tokens up to i took the name so far. a * can also
+take nothing, so whatever reaches the bit before one reaches it too*/
+static bool nfa_match(const struct pattern *p, const char *name){
+	const unsigned char *s;
+	uint64_t d;
+
+	d = 1;
+	d |= (d << 1) & p->stars;
+	for (s = (const unsigned char *)name; *s != '\0'; s++) {
+		d = ((d << 1) | (d & p->stars)) & p->accept[*s];
+		d |= (d << 1) & p->stars;
+		if (d == 0) {
+			return false;
+		}
+	}
+	return (d & p->final) != 0;
+}
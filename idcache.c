@@ -0,0 +1,283 @@
+/*idcache.c - uid/gid to name cache for long format*/
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * Open addressed, linear probing, power of two size. Every id looked up
+ * gets a slot, including ids with no passwd/group entry: those store the
+ * number as a string, so a missing id costs one NSS call per run, not
+ * one per file.
+ *
+ * ls looks names up from the printing thread only. --serve prints from
+ * every worker, so idcache_share loads the whole databases once and
+ * puts the tables behind a lock from then on.
+ */
+
+/*slots to start with, grows at 3/4 full*/
+#define IDCACHE_INIT	64
+/*distinct unknown ids past which priming walks the whole database once*/
+#define IDCACHE_ENUM_MIN	64
+
+struct id_slot {
+	uint32_t id;
+	bool used;
+	char *name;
+};
+
+struct id_table {
+	struct id_slot *slots;
+	size_t size;
+	size_t count;
+};
+
+static struct id_table users;
+static struct id_table groups;
+static bool shared;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct id_slot *id_find(struct id_table *t, uint32_t id);
+static struct id_slot *id_insert(struct id_table *t, uint32_t id);
+static void id_grow(struct id_table *t);
+static void id_set(struct id_slot *s, const char *name);
+static void fill_user(struct id_slot *s);
+static void fill_group(struct id_slot *s);
+static void id_enum(void);
+
+/*owner name for -l, the number if there is no passwd entry*/
+const char *user_name(uid_t uid){
+	struct id_slot *s;
+	const char *name;
+
+	if (shared) {
+		pthread_mutex_lock(&lock);
+	}
+	if ((s = id_find(&users, uid)) == NULL) {
+		s = id_insert(&users, uid);
+	}
+	if (s->name == NULL) {
+		fill_user(s);
+	}
+	/*names stay put when the slots grow, s does not*/
+	name = s->name;
+	if (shared) {
+		pthread_mutex_unlock(&lock);
+	}
+	return name;
+}
+
+/*group name for -l, the number if there is no group entry*/
+const char *group_name(gid_t gid){
+	struct id_slot *s;
+	const char *name;
+
+	if (shared) {
+		pthread_mutex_lock(&lock);
+	}
+	if ((s = id_find(&groups, gid)) == NULL) {
+		s = id_insert(&groups, gid);
+	}
+	if (s->name == NULL) {
+		fill_group(s);
+	}
+	name = s->name;
+	if (shared) {
+		pthread_mutex_unlock(&lock);
+	}
+	return name;
+}
+
+/*resolve every distinct uid and gid of a listing before printing.
+with many unknown ids the databases are read once with getpwent and
+getgrent, which beats one round trip each on LDAP/sssd*/
+void idcache_prime(const struct file_entry *files, int count){
+	struct id_slot *s;
+	struct passwd *pw;
+	struct group *gr;
+	size_t missing_users;
+	size_t missing_groups;
+	size_t i;
+
+	if (shared) {
+		pthread_mutex_lock(&lock);
+	}
+	/*slots with no name yet are ids seen but not resolved*/
+	missing_users = 0;
+	missing_groups = 0;
+	for (i = 0; i < (size_t)count; i++) {
+		if (id_find(&users, files[i].m.uid) == NULL) {
+			(void)id_insert(&users, files[i].m.uid);
+			missing_users++;
+		}
+		if (id_find(&groups, files[i].m.gid) == NULL) {
+			(void)id_insert(&groups, files[i].m.gid);
+			missing_groups++;
+		}
+	}
+
+	if (missing_users >= IDCACHE_ENUM_MIN) {
+		stats_add(STATS_PWLOOKUPS, 1);
+		setpwent();
+		while ((pw = getpwent()) != NULL) {
+			if ((s = id_find(&users, pw->pw_uid)) != NULL && s->name == NULL) {
+				id_set(s, pw->pw_name);
+			}
+		}
+		endpwent();
+	}
+	if (missing_groups >= IDCACHE_ENUM_MIN) {
+		stats_add(STATS_GRLOOKUPS, 1);
+		setgrent();
+		while ((gr = getgrent()) != NULL) {
+			if ((s = id_find(&groups, gr->gr_gid)) != NULL && s->name == NULL) {
+				id_set(s, gr->gr_name);
+			}
+		}
+		endgrent();
+	}
+
+	/*whatever enumeration didnt cover gets a direct lookup*/
+	for (i = 0; i < users.size; i++) {
+		if (users.slots[i].used && users.slots[i].name == NULL) {
+			fill_user(&users.slots[i]);
+		}
+	}
+	for (i = 0; i < groups.size; i++) {
+		if (groups.slots[i].used && groups.slots[i].name == NULL) {
+			fill_group(&groups.slots[i]);
+		}
+	}
+	if (shared) {
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/*every user and group name now, and a lock for the threads of --serve*/
+void idcache_share(void){
+	id_enum();
+	shared = true;
+}
+
+/*one pass over each database, ids already in are kept*/
+static void id_enum(void){
+	struct passwd *pw;
+	struct group *gr;
+
+	setpwent();
+	while ((pw = getpwent()) != NULL) {
+		if (id_find(&users, pw->pw_uid) == NULL) {
+			id_set(id_insert(&users, pw->pw_uid), pw->pw_name);
+		}
+	}
+	endpwent();
+	setgrent();
+	while ((gr = getgrent()) != NULL) {
+		if (id_find(&groups, gr->gr_gid) == NULL) {
+			id_set(id_insert(&groups, gr->gr_gid), gr->gr_name);
+		}
+	}
+	endgrent();
+}
+
+/*NSS lookup, a missing id is cached as its number*/
+static void fill_user(struct id_slot *s){
+	struct passwd *pw;
+	char buf[16];
+
+	stats_add(STATS_PWLOOKUPS, 1);
+	if ((pw = getpwuid(s->id)) != NULL) {
+		id_set(s, pw->pw_name);
+	} else {
+		(void)snprintf(buf, sizeof(buf), "%u", s->id);
+		id_set(s, buf);
+	}
+}
+
+static void fill_group(struct id_slot *s){
+	struct group *gr;
+	char buf[16];
+
+	stats_add(STATS_GRLOOKUPS, 1);
+	if ((gr = getgrgid(s->id)) != NULL) {
+		id_set(s, gr->gr_name);
+	} else {
+		(void)snprintf(buf, sizeof(buf), "%u", s->id);
+		id_set(s, buf);
+	}
+}
+
+static void id_set(struct id_slot *s, const char *name){
+	if ((s->name = strdup(name)) == NULL) {
+		err(1, NULL);
+	}
+}
+
+static size_t id_hash(uint32_t id, size_t size){
+	return (size_t)((id * 2654435761u) & (size - 1));
+}
+
+static struct id_slot *id_find(struct id_table *t, uint32_t id){
+	size_t i;
+
+	if (t->size == 0) {
+		return NULL;
+	}
+	for (i = id_hash(id, t->size); t->slots[i].used; i = (i + 1) & (t->size - 1)) {
+		if (t->slots[i].id == id) {
+			return &t->slots[i];
+		}
+	}
+	return NULL;
+}
+
+/*add id with no name yet, returns its slot. id must not be present*/
+static struct id_slot *id_insert(struct id_table *t, uint32_t id){
+	size_t i;
+
+	if ((t->count + 1) * 4 > t->size * 3) {
+		id_grow(t);
+	}
+	for (i = id_hash(id, t->size); t->slots[i].used; i = (i + 1) & (t->size - 1)) {
+		continue;
+	}
+	t->slots[i].id = id;
+	t->slots[i].used = true;
+	t->slots[i].name = NULL;
+	t->count++;
+	return &t->slots[i];
+}
+
+static void id_grow(struct id_table *t){
+	struct id_slot *old;
+	size_t oldsize;
+	size_t i;
+	size_t j;
+
+	old = t->slots;
+	oldsize = t->size;
+	t->size = oldsize == 0 ? IDCACHE_INIT : oldsize * 2;
+	if ((t->slots = calloc(t->size, sizeof(struct id_slot))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].used) {
+			continue;
+		}
+		for (j = id_hash(old[i].id, t->size); t->slots[j].used; j = (j + 1) & (t->size - 1)) {
+			continue;
+		}
+		t->slots[j] = old[i];
+	}
+	free(old);
+}
@@ -0,0 +1,328 @@
+/*libls.c - the libls.h API over the readers ls itself uses*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+#include "libls.h"
+
+/*
+ * A libls is a struct options like the command line would make, with
+ * the globs compiled, so every read goes through dents_next,
+ * listing_names, listing_stat and sort_entries exactly as read_directory
+ * does; only --cache, --du, --head/--tail and the printing stay in ls.
+ * It is always set up as for -R, which only adds the file type, so
+ * libls_walk can tell dirs, and with includes dirs are kept for it.
+ *
+ * Every allocation of those readers, ls or library, goes through
+ * lib_malloc and friends, so a libls_alloc sees all of it. Nothing here
+ * prints or exits: out of memory is ENOMEM, bad entries go to the
+ * config's error callback.
+ */
+
+struct libls {
+	struct options opts;
+	struct meta_plan plan;
+	void (*error)(void *arg, const char *dir, const char *name, int error);
+	void *arg;
+};
+
+struct libls_dir {
+	struct dir_listing dl;
+	size_t pos;
+	struct libls_entry cur;
+};
+
+/*what stat_error gets*/
+struct bad_entry {
+	const struct libls *l;
+	const char *path;
+};
+
+static struct libls_alloc alloc;
+
+static int dir_read(const struct libls *l, int atfd, const char *name, const char *path,
+    bool keep_fd, struct libls_dir **dp);
+static int walk_at(const struct libls *l, int atfd, const char *name, char **path,
+    size_t *cap, size_t len, int depth, libls_visit_fn visit, void *arg);
+static void stat_error(void *arg, const char *name, int error);
+
+/*use a for everything from here on, NULL for malloc again. set it
+before anything is allocated, memory must go back where it came from*/
+void libls_set_alloc(const struct libls_alloc *a){
+	if (a == NULL) {
+		(void)memset(&alloc, 0, sizeof(alloc));
+		return;
+	}
+	alloc = *a;
+}
+
+void *lib_malloc(size_t size){
+	if (alloc.malloc != NULL) {
+		return alloc.malloc(alloc.ctx, size);
+	}
+	return malloc(size);
+}
+
+void *lib_realloc(void *p, size_t size){
+	if (alloc.realloc != NULL) {
+		return alloc.realloc(alloc.ctx, p, size);
+	}
+	return realloc(p, size);
+}
+
+void lib_free(void *p){
+	if (p == NULL) {
+		return;
+	}
+	if (alloc.free != NULL) {
+		alloc.free(alloc.ctx, p);
+		return;
+	}
+	free(p);
+}
+
+/*a libls for cfg in *lp, freed with libls_free*/
+int libls_new(const struct libls_config *cfg, struct libls **lp){
+	struct libls *l;
+	struct options *o;
+	const char *const *g;
+
+	if (cfg->sort < LIBLS_SORT_NAME || cfg->sort > LIBLS_SORT_NONE ||
+	    cfg->time < LIBLS_MTIME || cfg->time > LIBLS_CTIME) {
+		return EINVAL;
+	}
+	if ((l = lib_malloc(sizeof(*l))) == NULL) {
+		return ENOMEM;
+	}
+	(void)memset(l, 0, sizeof(*l));
+	o = &l->opts;
+	o->show_all = (cfg->flags & LIBLS_ALL) != 0;
+	o->show_almost_all = (cfg->flags & LIBLS_ALMOST_ALL) != 0;
+	o->long_format = (cfg->flags & LIBLS_STAT) != 0;
+	o->reverse = (cfg->flags & LIBLS_REVERSE) != 0;
+	o->no_sync = (cfg->flags & LIBLS_NO_SYNC) != 0;
+	o->recursive = true;
+	o->unsorted = cfg->sort == LIBLS_SORT_NONE;
+	o->sort_time = cfg->sort == LIBLS_SORT_TIME;
+	o->sort_size = cfg->sort == LIBLS_SORT_SIZE;
+	o->use_atime = cfg->time == LIBLS_ATIME;
+	o->use_ctime = cfg->time == LIBLS_CTIME;
+	o->getdents_buf = GETDENTS_BUF;
+	o->max_depth = cfg->max_depth;
+	for (g = cfg->include; g != NULL && *g != NULL; g++) {
+		if (!filter_add(o, *g, true)) {
+			libls_free(l);
+			return ENOMEM;
+		}
+	}
+	for (g = cfg->exclude; g != NULL && *g != NULL; g++) {
+		if (!filter_add(o, *g, false)) {
+			libls_free(l);
+			return ENOMEM;
+		}
+	}
+	meta_plan(o, &l->plan);
+	l->error = cfg->error;
+	l->arg = cfg->arg;
+	*lp = l;
+	return 0;
+}
+
+void libls_free(struct libls *l){
+	if (l == NULL) {
+		return;
+	}
+	filter_free(l->opts.filter);
+	lib_free(l);
+}
+
+/*read path, relative to atfd (or AT_FDCWD), into *dp, sorted*/
+int libls_open(const struct libls *l, int atfd, const char *path, struct libls_dir **dp){
+	return dir_read(l, atfd, path, path, false, dp);
+}
+
+/*next entry in sort order, NULL after the last*/
+const struct libls_entry *libls_next(struct libls_dir *d){
+	const struct file_entry *fe;
+
+	if (d->pos >= (size_t)d->dl.count) {
+		return NULL;
+	}
+	fe = &d->dl.files[d->pos++];
+	d->cur.name = fe->name;
+	d->cur.link = fe->link;
+	d->cur.ino = fe->m.ino;
+	d->cur.size = fe->m.size;
+	d->cur.blocks = fe->m.blocks;
+	d->cur.time = fe->m.time;
+	d->cur.mode = fe->m.mode;
+	d->cur.nlink = fe->m.nlink;
+	d->cur.uid = fe->m.uid;
+	d->cur.gid = fe->m.gid;
+	return &d->cur;
+}
+
+size_t libls_count(const struct libls_dir *d){
+	return (size_t)d->dl.count;
+}
+
+/*libls_next from the first entry again*/
+void libls_rewind(struct libls_dir *d){
+	d->pos = 0;
+}
+
+void libls_close(struct libls_dir *d){
+	if (d == NULL) {
+		return;
+	}
+	arena_free(&d->dl.names);
+	lib_free(d->dl.files);
+	if (d->dl.fd >= 0) {
+		(void)close(d->dl.fd);
+	}
+	lib_free(d);
+}
+
+/*visit path and the dirs below it, depth first as ls -R lists them.
+0, the first nonzero visit return, or an errno: for path itself, or
+ENOMEM. dirs below path that cant be read go to the error callback*/
+int libls_walk(const struct libls *l, const char *path, libls_visit_fn visit, void *arg){
+	char *buf;
+	size_t cap;
+	size_t len;
+	int r;
+
+	len = strlen(path);
+	cap = len + 256;
+	if ((buf = lib_malloc(cap)) == NULL) {
+		return ENOMEM;
+	}
+	(void)memcpy(buf, path, len + 1);
+	r = walk_at(l, AT_FDCWD, path, &buf, &cap, len, 0, visit, arg);
+	lib_free(buf);
+	return r;
+}
+
+/*one dir of libls_walk, its path in *path[0..len). path grows as
+needed and is back to len on return*/
+static int walk_at(const struct libls *l, int atfd, const char *name, char **path,
+    size_t *cap, size_t len, int depth, libls_visit_fn visit, void *arg){
+	struct libls_dir *d;
+	const char *kid;
+	size_t klen;
+	size_t need;
+	int r;
+	int i;
+
+	if ((r = dir_read(l, atfd, name, *path, true, &d)) != 0) {
+		if (depth == 0 || r == ENOMEM) {
+			return r;
+		}
+		if (l->error != NULL) {
+			l->error(l->arg, *path, NULL, r);
+		}
+		return 0;
+	}
+	if ((r = visit(arg, *path, depth, d)) != 0 || !is_within_depth(depth + 1, &l->opts)) {
+		libls_close(d);
+		return r;
+	}
+	for (i = 0; i < d->dl.count && r == 0; i++) {
+		if (!is_recurse_dir(&d->dl.files[i], &l->opts)) {
+			continue;
+		}
+		kid = d->dl.files[i].name;
+		klen = strlen(kid);
+		need = len + 1 + klen + 1;
+		if (need > *cap) {
+			char *p;
+
+			if ((p = lib_realloc(*path, need * 2)) == NULL) {
+				r = ENOMEM;
+				break;
+			}
+			*path = p;
+			*cap = need * 2;
+		}
+		/*no second slash after a path that ends in one*/
+		need = len;
+		if (len > 0 && (*path)[len - 1] != '/') {
+			(*path)[need++] = '/';
+		}
+		(void)memcpy(*path + need, kid, klen + 1);
+		r = walk_at(l, d->dl.fd, kid, path, cap, need + klen, depth + 1, visit, arg);
+		(*path)[len] = '\0';
+	}
+	libls_close(d);
+	return r;
+}
+
+/*name relative to atfd into a new libls_dir, path for the callback*/
+static int dir_read(const struct libls *l, int atfd, const char *name, const char *path,
+    bool keep_fd, struct libls_dir **dp){
+	struct libls_dir *d;
+	struct listing_scan scan;
+	struct bad_entry be;
+	struct dents dd;
+	int fd;
+	int r;
+
+	if ((d = lib_malloc(sizeof(*d))) == NULL) {
+		return ENOMEM;
+	}
+	(void)memset(d, 0, sizeof(*d));
+	arena_init(&d->dl.names);
+	d->dl.fd = -1;
+	d->dl.path = path;
+	if ((fd = openat(atfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		r = errno;
+		lib_free(d);
+		return r;
+	}
+	if (!dents_open(&dd, fd, &d->dl.names, &l->opts)) {
+		r = dd.error;
+		(void)close(fd);
+		libls_close(d);
+		return r;
+	}
+	r = listing_names(&dd, &l->plan, &scan);
+	dents_close(&dd);
+	if (r == 0) {
+		be.l = l;
+		be.path = path;
+		r = listing_stat(fd, &l->opts, &l->plan, &scan, &d->dl, stat_error, &be);
+	}
+	if (r != 0) {
+		(void)close(fd);
+		libls_close(d);
+		return r;
+	}
+	sort_entries(scan.files, scan.count, &l->opts);
+	d->dl.files = scan.files;
+	d->dl.count = scan.count;
+	if (keep_fd) {
+		d->dl.fd = fd;
+	} else {
+		(void)close(fd);
+	}
+	*dp = d;
+	return 0;
+}
+
+/*listing_stat callback, on to the config's*/
+static void stat_error(void *arg, const char *name, int error){
+	const struct bad_entry *be = arg;
+
+	if (be->l->error != NULL) {
+		be->l->error(be->l->arg, be->path, name, error);
+	}
+}
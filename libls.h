@@ -0,0 +1,94 @@
+/*libls.h - ls's directory reading, in process: sorted listings, no
+output, no exits. link with libls.a (or libls.so) and -lpthread*/
+
+#ifndef _LIBLS_H_
+#define _LIBLS_H_
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define LIBLS_API	__attribute__((visibility("default")))
+#else
+#define LIBLS_API
+#endif
+
+/*libls_config flags*/
+#define LIBLS_ALL	0x01	/* dot files, . and .. too (-a) */
+#define LIBLS_ALMOST_ALL	0x02	/* dot files but not . and .. (-A) */
+#define LIBLS_STAT	0x04	/* every field and link targets (-l), else name, ino, type */
+#define LIBLS_REVERSE	0x08	/* -r */
+#define LIBLS_NO_SYNC	0x10	/* cached attributes will do (--no-sync) */
+
+/*libls_config sort*/
+#define LIBLS_SORT_NAME	0
+#define LIBLS_SORT_TIME	1	/* newest first (-t) */
+#define LIBLS_SORT_SIZE	2	/* largest first (-S) */
+#define LIBLS_SORT_NONE	3	/* as the directory has them (-f) */
+
+/*libls_config time*/
+#define LIBLS_MTIME	0
+#define LIBLS_ATIME	1	/* -u */
+#define LIBLS_CTIME	2	/* -c */
+
+/*where libls gets memory, ctx is passed back. all three or none*/
+struct libls_alloc {
+	void *(*malloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *p, size_t size);
+	void (*free)(void *ctx, void *p);
+	void *ctx;
+};
+
+/*what to list and how, see libls_new*/
+struct libls_config {
+	unsigned int flags;	/* LIBLS_* */
+	int sort;		/* LIBLS_SORT_* */
+	int time;		/* LIBLS_*TIME, sorted on and in libls_entry */
+	int max_depth;		/* levels libls_walk goes down, -1 for all */
+	/*NULL terminated globs, or NULL, as for --include/--exclude.
+	dirs matching no include are still returned by libls_next, as
+	with ls -R, so libls_walk can go into them; check the mode*/
+	const char *const *include;
+	const char *const *exclude;
+	/*called for entries left out because they could not be stat'd,
+	and with name NULL for dirs libls_walk could not read. may be NULL*/
+	void (*error)(void *arg, const char *dir, const char *name, int error);
+	void *arg;
+};
+
+/*one entry, good until its libls_dir is closed*/
+struct libls_entry {
+	const char *name;
+	const char *link;	/* symlink target with LIBLS_STAT, else NULL */
+	uint64_t ino;
+	int64_t size;		/* size to gid only with LIBLS_STAT */
+	int64_t blocks;		/* 512-byte units */
+	int64_t time;		/* the config's time, seconds */
+	mode_t mode;		/* file type bits only without LIBLS_STAT */
+	uint32_t nlink;
+	uid_t uid;
+	gid_t gid;
+};
+
+struct libls;		/* a config, ready to use */
+struct libls_dir;	/* one directory, read and sorted */
+
+/*called by libls_walk for every dir, parents first, subdirs in the
+order of their parent's listing. d is closed when it returns and a
+nonzero return ends the walk with that value*/
+typedef int (*libls_visit_fn)(void *arg, const char *path, int depth, struct libls_dir *d);
+
+/*functions returning int give 0 or an errno value*/
+LIBLS_API void libls_set_alloc(const struct libls_alloc *a);
+LIBLS_API int libls_new(const struct libls_config *cfg, struct libls **lp);
+LIBLS_API void libls_free(struct libls *l);
+LIBLS_API int libls_open(const struct libls *l, int atfd, const char *path, struct libls_dir **dp);
+LIBLS_API const struct libls_entry *libls_next(struct libls_dir *d);
+LIBLS_API size_t libls_count(const struct libls_dir *d);
+LIBLS_API void libls_rewind(struct libls_dir *d);
+LIBLS_API void libls_close(struct libls_dir *d);
+LIBLS_API int libls_walk(const struct libls *l, const char *path, libls_visit_fn visit, void *arg);
+
+#endif
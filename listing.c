@@ -0,0 +1,178 @@
+/*listing.c - a directory into a listing, the part ls and libls share*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * A listing is read in two passes with a pause between them, so ls
+ * can time them apart for --stats: listing_names takes every name d
+ * lets through and fills what the dirent can, listing_stat stats the
+ * rest as one batch and reads link targets. Sorting is sort_entries.
+ * Neither prints or exits; allocation failures come back as ENOMEM
+ * and entries that cant be stat'd go to a callback and are left out.
+ */
+
+static void listing_drop(struct listing_scan *s);
+
+/*names d reads into s, and what mp needs of them the dirent has.
+0 or an errno, on errors s holds nothing*/
+int listing_names(struct dents *d, const struct meta_plan *mp, struct listing_scan *s){
+	struct dirent *entry;
+	struct file_entry *fe;
+
+	s->count = 0;
+	s->capacity = 64;
+	s->pending = NULL;
+	s->npending = 0;
+	s->pending_cap = 0;
+	s->nlinks = 0;
+	if ((s->files = lib_malloc(s->capacity * sizeof(struct file_entry))) == NULL) {
+		return ENOMEM;
+	}
+
+	/*-a/-A and the filter already applied*/
+	while ((entry = dents_next(d)) != NULL) {
+		if (s->count >= s->capacity) {
+			struct file_entry *new_files;
+
+			new_files = lib_realloc(s->files, s->capacity * 2 * sizeof(struct file_entry));
+			if (new_files == NULL) {
+				listing_drop(s);
+				return ENOMEM;
+			}
+			s->files = new_files;
+			s->capacity *= 2;
+		}
+		fe = &s->files[s->count];
+
+		/*filename, where the kernel put it*/
+		if ((fe->name = dents_name(d, entry)) == NULL) {
+			listing_drop(s);
+			return ENOMEM;
+		}
+		fe->link = NULL;
+
+		/*metadata from the dirent if it will do, else stat later*/
+		if (mp->need != 0 && !meta_from_dirent(mp, entry, &fe->m)) {
+			if (s->npending >= s->pending_cap) {
+				int *new_pending;
+				int cap;
+
+				cap = s->pending_cap == 0 ? 64 : s->pending_cap * 2;
+				if ((new_pending = lib_realloc(s->pending, cap * sizeof(int))) == NULL) {
+					listing_drop(s);
+					return ENOMEM;
+				}
+				s->pending = new_pending;
+				s->pending_cap = cap;
+			}
+			s->pending[s->npending++] = s->count;
+		}
+		s->count++;
+	}
+	/*getdents64 failing half way is running out of memory too*/
+	if (d->error == ENOMEM) {
+		listing_drop(s);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*stat the entries of s that need it, relative to the dir fd, and
+leave s->files with the ones that could be, link targets read into
+dl's arena and totals added to dl. the rest go to bad. 0 or ENOMEM,
+on errors s holds nothing*/
+int listing_stat(int fd, const struct options *opts, const struct meta_plan *mp,
+    struct listing_scan *s, struct dir_listing *dl,
+    void (*bad)(void *arg, const char *name, int error), void *arg){
+	int *errs;
+	int kept;
+	int i;
+	int j;
+
+	/*stat the rest as one batch, so io_uring can overlap them*/
+	errs = NULL;
+	if (s->npending > 0) {
+		if ((errs = lib_malloc(s->npending * sizeof(int))) == NULL) {
+			listing_drop(s);
+			return ENOMEM;
+		}
+		meta_stat_batch(fd, s->files, s->pending, s->npending, mp, errs);
+	}
+
+	/*drop what couldnt be stat'd, pending is in entry order*/
+	kept = 0;
+	j = 0;
+	for (i = 0; i < s->count; i++) {
+		if (j < s->npending && s->pending[j] == i) {
+			if (errs[j++] != 0) {
+				if (bad != NULL) {
+					bad(arg, s->files[i].name, errs[j - 1]);
+				}
+				continue;
+			}
+			/*link target now, while the dir is open*/
+			if (wants_link(opts) && S_ISLNK(s->files[i].m.mode)) {
+				s->nlinks++;
+				s->files[i].link = read_link_at(fd, s->files[i].name, &dl->names);
+			}
+			dl->total_size_bytes += s->files[i].m.size;
+			dl->total_blocks += s->files[i].m.blocks;
+		}
+		s->files[kept++] = s->files[i];
+	}
+	s->count = kept;
+	lib_free(s->pending);
+	s->pending = NULL;
+	s->npending = 0;
+	lib_free(errs);
+	return 0;
+}
+
+/*false for dir entries the -a/-A flags hide*/
+bool is_listed_name(const char *name, const struct options *opts){
+	/*skip . and .. unless -a*/
+	/*need to check for A, so if A exclude . and ..
+	keep the rest*/
+	if (opts->show_all) {
+		return true;
+	}
+	if (opts->show_almost_all) {
+		return strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+	}
+	return name[0] != '.';
+}
+
+/*true if -R should descend into this entry of a listing.
+skips . and .., hidden unless -a, and sym links*/
+bool is_recurse_dir(const struct file_entry *fe, const struct options *opts){
+	if (strcmp(fe->name, ".") == 0 || strcmp(fe->name, "..") == 0) {
+		return false;
+	}
+	if (!opts->show_all && fe->name[0] == '.') {
+		return false;
+	}
+	return S_ISDIR(fe->m.mode);
+}
+
+/*true if -R lists dirs depth levels below an operand, --max-depth*/
+bool is_within_depth(int depth, const struct options *opts){
+	return opts->max_depth < 0 || depth <= opts->max_depth;
+}
+
+static void listing_drop(struct listing_scan *s){
+	lib_free(s->files);
+	lib_free(s->pending);
+	s->files = NULL;
+	s->pending = NULL;
+	s->count = 0;
+	s->npending = 0;
+}
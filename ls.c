@@ -6,6 +6,8 @@
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,14 +17,76 @@
 
 #include "ls.h"
 
-static void usage(void);
-static void parse_options(int argc, char *argv[], struct options *opts);
+/*long only options*/
+#define OPT_NO_SYNC	256
+#define OPT_URING	257
+#define OPT_NO_TOTAL	258
+#define OPT_HEAD	259
+#define OPT_TAIL	260
+#define OPT_STATS	261
+#define OPT_STATS_TRACE	262
+#define OPT_ZERO	263
+#define OPT_JSON	264
+#define OPT_CACHE	265
+#define OPT_WATCH	266
+#define OPT_DU	267
+#define OPT_GETDENTS_BUF	268
+#define OPT_INCLUDE	269
+#define OPT_EXCLUDE	270
+#define OPT_MAX_DEPTH	271
+#define OPT_SERVE	272
+#define OPT_CLIENT	273
+
+static const struct option long_options[] = {
+	{ "no-sync",	no_argument,	NULL,	OPT_NO_SYNC },
+	{ "uring",	no_argument,	NULL,	OPT_URING },
+	{ "no-total",	no_argument,	NULL,	OPT_NO_TOTAL },
+	{ "head",	required_argument,	NULL,	OPT_HEAD },
+	{ "tail",	required_argument,	NULL,	OPT_TAIL },
+	{ "stats",	no_argument,	NULL,	OPT_STATS },
+	{ "stats-trace",	required_argument,	NULL,	OPT_STATS_TRACE },
+	{ "zero",	no_argument,	NULL,	OPT_ZERO },
+	{ "json",	no_argument,	NULL,	OPT_JSON },
+	{ "cache",	required_argument,	NULL,	OPT_CACHE },
+	{ "watch",	no_argument,	NULL,	OPT_WATCH },
+	{ "du",	no_argument,	NULL,	OPT_DU },
+	{ "getdents-buf",	required_argument,	NULL,	OPT_GETDENTS_BUF },
+	{ "include",	required_argument,	NULL,	OPT_INCLUDE },
+	{ "exclude",	required_argument,	NULL,	OPT_EXCLUDE },
+	{ "max-depth",	required_argument,	NULL,	OPT_MAX_DEPTH },
+	{ "serve",	required_argument,	NULL,	OPT_SERVE },
+	{ "client",	required_argument,	NULL,	OPT_CLIENT },
+	{ NULL,		0,		NULL,	0 }
+};
+
+static const char usage_text[] =
+    "usage: ls [-1AacdFfhiklnqRrSstuw] [-j jobs] [--no-sync] [--uring] [--no-total]\n"
+    "          [--head n | --tail n]\n"
+    "          [--stats] [--stats-trace file] [--zero | --json] [--cache dir] [--watch] [--du]\n"
+    "          [--getdents-buf size]\n"
+    "          [--include glob] [--exclude glob] [--max-depth n]\n"
+    "          [--serve socket | --client socket] [file ...]\n";
+
+static bool parse_count(const char *arg, int *count);
+static bool parse_buf_size(const char *arg, size_t *size);
+static bool parse_depth(const char *arg, int *depth);
+static bool list_at(int atfd, const char *name, const char *path,
+    const struct options *opts, struct dir_listing *dl);
+static void recurse_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool print_name, int depth);
+static void warn_stat(void *arg, const char *name, int error);
+
+/*what warn_stat gets*/
+struct stat_failed {
+	const char *path;
+	bool *cacheable;
+};
 
 
 /*entry for ls*/
 int main(int argc, char *argv[]) {
 	struct options opts;
-	int i;
+	int status;
 	bool has_args;
 
 	/*init flags to false */
@@ -31,48 +95,158 @@ int main(int argc, char *argv[]) {
 
 	/*parse flags*/
 	parse_options(argc, argv, &opts);
+	/*the daemon only returns on a signal, see serve.c*/
+	if (opts.serve != NULL) {
+		status = serve_run(opts.serve, &opts);
+		filter_free(opts.filter);
+		return status;
+	}
+	if (opts.client != NULL && client_run(opts.client, argc, argv, &opts, &status)) {
+		filter_free(opts.filter);
+		return status;
+	}
+	if (opts.stats || opts.stats_trace != NULL) {
+		stats_init(opts.stats_trace);
+	}
+	if (opts.zero) {
+		out_set_eol('\0');
+	}
+	/*a cache that cant be used is only slower*/
+	if (opts.cache_dir != NULL && !cache_init(opts.cache_dir)) {
+		opts.cache_dir = NULL;
+	}
 
 	/*check for file/dir args*/
 	has_args = (optind < argc);
 
-	if (!has_args) {
+	/*only returns when there is nothing left to watch*/
+	if (opts.watch) {
+		static char *const dot[] = { "." };
+
+		watch_run(has_args ? &argv[optind] : dot, has_args ? argc - optind : 1, &opts);
+		out_flush();
+		filter_free(opts.filter);
+		return EXIT_FAILURE;
+	}
+
+	list_operands(&argv[optind], argc - optind, &opts);
+	out_flush();
+	stats_report();
+	filter_free(opts.filter);
+	return EXIT_SUCCESS;
+}
+
+/*list the n operands in paths, . if there are none. what main does
+after the options, and a --serve worker for each request*/
+void list_operands(char *const paths[], int n, const struct options *opts){
+	struct file_entry *files;
+	struct file_entry *dirs;
+	struct arena links;
+	bool *isdir;
+	int *errs;
+	int nfiles;
+	int ndirs;
+	uint64_t t;
+	int i;
+
+	if (n == 0) {
 		/*no args = current dir used*/
-		if (opts.dir_as_file) {
+		if (opts->dir_as_file) {
 			/*-d flag, show . as a file*/
-			ls_file(".", &opts);
-		} else if (opts.recursive) {
-			process_recursively(".", &opts, false);
+			ls_file(".", opts);
+		} else if (opts->du || (opts->recursive && opts->jobs > 1)) {
+			process_recursively_parallel(".", opts, false);
+		} else if (opts->recursive) {
+			process_recursively(".", opts, false);
 		} else {
-			ls_directory(".", &opts);
+			ls_directory(".", opts);
 		}
+		return;
 	}
-	else {
-		/*list each*/
-		for (i = optind; i < argc; i++) {
-			if (opts.dir_as_file) {
-				//treat directories as plain files when -d
-				ls_file(argv[i], &opts);
-				continue;
-			}
-			if (is_directory(argv[i])) {
-				if (opts.recursive) {
-					process_recursively(argv[i], &opts, argc - optind > 1);
-				} else {
-					ls_directory(argv[i], &opts);
-				}
-			} 
-			else {
-				//when specific files named in args
-				ls_file(argv[i], &opts);
+	/*one stat each up front, then every file in one sorted block
+	like ls does, the dirs after it in the same order*/
+	if ((files = malloc((size_t)n * sizeof(struct file_entry))) == NULL ||
+	    (dirs = malloc((size_t)n * sizeof(struct file_entry))) == NULL ||
+	    (isdir = malloc((size_t)n * sizeof(bool))) == NULL ||
+	    (errs = malloc((size_t)n * sizeof(int))) == NULL) {
+		err(1, NULL);
+	}
+	t = stats_now();
+	stat_operands(paths, n, opts, files, isdir, errs);
+	stats_time(STATS_STAT, t, NULL);
+	arena_init(&links);
+	nfiles = 0;
+	ndirs = 0;
+	for (i = 0; i < n; i++) {
+		if (errs[i] != 0) {
+			errno = errs[i];
+			out_warn("cannot access '%s'", paths[i]);
+			continue;
+		}
+		if (isdir[i]) {
+			dirs[ndirs++] = files[i];
+			continue;
+		}
+		files[nfiles] = files[i];
+		if (wants_link(opts) && S_ISLNK(files[nfiles].m.mode)) {
+			stats_add(STATS_READLINKS, 1);
+			files[nfiles].link = read_link_at(AT_FDCWD, paths[i], &links);
+		}
+		nfiles++;
+	}
+
+	t = stats_format_start();
+	sort_entries(files, nfiles, opts);
+	print_files(files, nfiles, NULL, opts);
+	stats_time(STATS_FORMAT, t, NULL);
+	arena_free(&links);
+
+	sort_entries(dirs, ndirs, opts);
+	for (i = 0; i < ndirs; i++) {
+		/*blank line between blocks, a name over each with more than one*/
+		if (!opts->json && (nfiles > 0 || i > 0)) {
+			out_eol();
+		}
+		if (opts->du || (opts->recursive && opts->jobs > 1)) {
+			process_recursively_parallel(dirs[i].name, opts, n > 1);
+		} else if (opts->recursive) {
+			process_recursively(dirs[i].name, opts, n > 1);
+		} else {
+			if (n > 1 && !opts->json) {
+				out_str(dirs[i].name);
+				out_char(':');
+				out_eol();
 			}
+			ls_directory(dirs[i].name, opts);
 		}
 	}
-	return EXIT_SUCCESS;
+	free(errs);
+	free(isdir);
+	free(dirs);
+	free(files);
+}
+
+/*parse flags, exiting on a bad one*/
+void parse_options(int argc, char *argv[], struct options *opts) {
+	char msg[PARSE_MSG_LEN];
+
+	switch (parse_options_msg(argc, argv, opts, msg, sizeof(msg))) {
+	case PARSE_ERROR:
+		errx(EXIT_FAILURE, "%s", msg);
+	case PARSE_USAGE:
+		(void)fputs(msg, stderr);
+		exit(EXIT_FAILURE);
+	}
 }
 
-/*parse flags*/
-static void parse_options(int argc, char *argv[], struct options *opts) {
+/*parse flags without exiting: PARSE_OK, or PARSE_ERROR with the
+message for errx in msg, or PARSE_USAGE with the text for stderr.
+getopt starts over, --serve workers parse each request (under a lock,
+opterr off), with out_open on the client's stdout for the isatty*/
+int parse_options_msg(int argc, char *argv[], struct options *opts, char *msg, size_t len) {
 	int ch;
+	long jobs;
+	char *ep;
 	opts->show_all=false;       /* -a all . files including . and .. */
 	opts->show_almost_all=false;  /*-A all . files except . and .. */
 	opts->long_format=false;    /* -l long listing format */
@@ -91,20 +265,48 @@ static void parse_options(int argc, char *argv[], struct options *opts) {
     opts->blocks=false;            /* -s */
     opts->dir_as_file=false;       /* -d */
 	opts->printable_only=false;    /* -q */
+	opts->jobs=0;                  /* -j */
+	opts->no_sync=false;           /* --no-sync */
+	opts->uring=false;             /* --uring */
+	opts->one_per_line=false;      /* -1 */
+	opts->no_total=false;          /* --no-total */
+	opts->head=0;                  /* --head */
+	opts->tail=0;                  /* --tail */
+	opts->stats=false;             /* --stats */
+	opts->stats_trace=NULL;        /* --stats-trace */
+	opts->zero=false;              /* --zero */
+	opts->json=false;              /* --json */
+	opts->cache_dir=NULL;          /* --cache */
+	opts->watch=false;             /* --watch */
+	opts->du=false;                /* --du */
+	opts->getdents_buf=GETDENTS_BUF; /* --getdents-buf */
+	opts->filter=NULL;             /* --include/--exclude */
+	opts->max_depth=-1;            /* --max-depth */
+	opts->serve=NULL;              /* --serve */
+	opts->client=NULL;             /* --client */
 	/*detect if output to terminal for -q/default behavior*/
-	if (isatty(STDOUT_FILENO)) {
+	if (isatty(out_fd())) {
 		opts->printable_only=true;
 	}
 	/*sets -A flag if superuser*/
 	if (geteuid() == 0) {
 		opts->show_almost_all=true;
 	}
-	while ((ch = getopt(argc, argv, "-AacdFfhiklnqRrSstuw")) != -1) {
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optreset = 1;
+	optind = 1;
+#endif
+	while ((ch = getopt_long(argc, argv, "-1AacdFfhij:klnqRrSstuw", long_options, NULL)) != -1) {
 		switch (ch) {
 		case 1:
         	/*printf("ls: unknown option -- %d\n", ch);*/
-			usage();
-        break; 
+			(void)snprintf(msg, len, "%s", usage_text);
+			return PARSE_USAGE;
+		case '1':
+			opts->one_per_line = true;
+			break;
 		case 'a':
 			opts->show_all = true;
 			break;
@@ -153,6 +355,15 @@ static void parse_options(int argc, char *argv[], struct options *opts) {
 			opts->human_readable = true;
 			opts->kilobytes = false;
 			break;
+		case 'j':
+			errno = 0;
+			jobs = strtol(optarg, &ep, 10);
+			if (errno != 0 || *ep != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+				(void)snprintf(msg, len, "invalid number of jobs: %s", optarg);
+				return PARSE_ERROR;
+			}
+			opts->jobs = (int)jobs;
+			break;
 		case 'k':
 			opts->kilobytes = true;
 			opts->human_readable = false;
@@ -169,264 +380,515 @@ static void parse_options(int argc, char *argv[], struct options *opts) {
 		case 'q':
 			opts->printable_only = true;
 			break;
+		case OPT_NO_SYNC:
+			opts->no_sync = true;
+			break;
+		case OPT_URING:
+			opts->uring = true;
+			break;
+		case OPT_NO_TOTAL:
+			opts->no_total = true;
+			break;
+		case OPT_HEAD:
+			if (!parse_count(optarg, &opts->head)) {
+				(void)snprintf(msg, len, "invalid number of entries: %s", optarg);
+				return PARSE_ERROR;
+			}
+			opts->tail = 0;
+			break;
+		case OPT_TAIL:
+			if (!parse_count(optarg, &opts->tail)) {
+				(void)snprintf(msg, len, "invalid number of entries: %s", optarg);
+				return PARSE_ERROR;
+			}
+			opts->head = 0;
+			break;
+		case OPT_STATS:
+			opts->stats = true;
+			break;
+		case OPT_STATS_TRACE:
+			opts->stats_trace = optarg;
+			break;
+		case OPT_ZERO:
+			opts->zero = true;
+			opts->json = false;
+			break;
+		case OPT_JSON:
+			opts->json = true;
+			opts->zero = false;
+			break;
+		case OPT_CACHE:
+			opts->cache_dir = optarg;
+			break;
+		case OPT_WATCH:
+			opts->watch = true;
+			break;
+		case OPT_DU:
+			opts->du = true;
+			break;
+		case OPT_GETDENTS_BUF:
+			if (!parse_buf_size(optarg, &opts->getdents_buf)) {
+				(void)snprintf(msg, len, "invalid buffer size: %s (64K to 64M)", optarg);
+				return PARSE_ERROR;
+			}
+			break;
+		case OPT_INCLUDE:
+			if (!filter_add(opts, optarg, true)) {
+				(void)snprintf(msg, len, "%s", strerror(errno));
+				return PARSE_ERROR;
+			}
+			break;
+		case OPT_EXCLUDE:
+			if (!filter_add(opts, optarg, false)) {
+				(void)snprintf(msg, len, "%s", strerror(errno));
+				return PARSE_ERROR;
+			}
+			break;
+		case OPT_MAX_DEPTH:
+			if (!parse_depth(optarg, &opts->max_depth)) {
+				(void)snprintf(msg, len, "invalid depth: %s", optarg);
+				return PARSE_ERROR;
+			}
+			break;
+		case OPT_SERVE:
+			opts->serve = optarg;
+			break;
+		case OPT_CLIENT:
+			opts->client = optarg;
+			break;
 		case 'w':
 			opts->printable_only = false;
 			break;
 		default:
-			fprintf(stderr, "ls: unknown option -- %d\n", ch);
-			usage();
-			exit(EXIT_FAILURE);
+			(void)snprintf(msg, len, "ls: unknown option -- %d\n%s", ch, usage_text);
+			return PARSE_USAGE;
 		}
 	}
+	/*machine readable output is one entry a line, names untouched*/
+	if (opts->zero) {
+		opts->one_per_line = true;
+	}
+	if (opts->zero || opts->json) {
+		opts->printable_only = false;
+	}
+	/*--watch keeps whole listings of dirs*/
+	if (opts->watch && (opts->head > 0 || opts->tail > 0 || opts->dir_as_file)) {
+		(void)snprintf(msg, len, "--watch does not go with --head, --tail or -d");
+		return PARSE_ERROR;
+	}
+	/*--du needs every entry of every listing*/
+	if (opts->du && (opts->head > 0 || opts->tail > 0 || opts->watch)) {
+		(void)snprintf(msg, len, "--du does not go with --head, --tail or --watch");
+		return PARSE_ERROR;
+	}
+	if (opts->serve != NULL && opts->client != NULL) {
+		(void)snprintf(msg, len, "--serve does not go with --client");
+		return PARSE_ERROR;
+	}
+	return PARSE_OK;
 }
 
-/*list contents of a dir*/
-void ls_directory(const char *path, const struct options *opts){
-	DIR *dir;
-	struct dirent *entry;
-	struct file_entry *files;
-	char *fullpath;
-	int capacity;
-	int count;
-	int i;
-	uint64_t total_blocks = 0;
-	uint64_t total_size_bytes = 0;
-	
-	if ((dir = opendir(path)) == NULL) {
-		warn("cannot access '%s'", path);
-		return;
+/*--getdents-buf size, bytes or with a K or M suffix*/
+static bool parse_buf_size(const char *arg, size_t *size){
+	unsigned long long n;
+	char *ep;
+
+	errno = 0;
+	n = strtoull(arg, &ep, 10);
+	if (*ep == 'K' || *ep == 'k') {
+		n = n > ULLONG_MAX / 1024 ? ULLONG_MAX : n * 1024;
+		ep++;
+	} else if (*ep == 'M' || *ep == 'm') {
+		n = n > ULLONG_MAX / (1024 * 1024) ? ULLONG_MAX : n * 1024 * 1024;
+		ep++;
+	}
+	if (errno != 0 || ep == arg || *ep != '\0' || n < GETDENTS_BUF_MIN || n > GETDENTS_BUF_MAX) {
+		return false;
 	}
+	*size = (size_t)n;
+	return true;
+}
 
-	/*alloc initial array for files*/
-	capacity = 64;
-	count = 0;
-	if ((files = malloc(capacity * sizeof(struct file_entry))) == NULL) {
-		err(1, NULL);
+/*levels for --max-depth, 0 is the operand alone*/
+static bool parse_depth(const char *arg, int *depth){
+	long n;
+	char *ep;
+
+	errno = 0;
+	n = strtol(arg, &ep, 10);
+	if (errno != 0 || ep == arg || *ep != '\0' || n < 0 || n > INT_MAX) {
+		return false;
 	}
+	*depth = (int)n;
+	return true;
+}
 
-	/*read all dir entries*/
-	while ((entry = readdir(dir)) != NULL) {
-		/*skip . and .. unless -a*/
-		/*need to check for A, so if A exclude . and ..
-		keep the rest*/
-		if (!(opts->show_all)) {
-			if(opts->show_almost_all){
-				if (!((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))) {
-					goto dirbody;
-				}
-			}
-			if (entry->d_name[0] == '.') {
-				continue;
-			}
-		}
-		dirbody:
-		/*expand array if needed*/
-		if (count >= capacity) {
-			struct file_entry *new_files;
-
-			capacity *= 2;
-			new_files = realloc(files, 
-			    capacity * sizeof(struct file_entry));
-			if (new_files == NULL) {
-				err(1, NULL);
-			}
-			files = new_files;
-		}
+/*entry count for --head/--tail*/
+static bool parse_count(const char *arg, int *count){
+	long n;
+	char *ep;
 
-		/*filename*/
-		if ((files[count].name = strdup(entry->d_name)) == NULL) {
-			err(1, NULL);
+	errno = 0;
+	n = strtol(arg, &ep, 10);
+	if (errno != 0 || *ep != '\0' || n < 1 || n > INT_MAX) {
+		return false;
+	}
+	*count = (int)n;
+	return true;
+}
+
+/*read contents of a dir into dl, sorted.
+returns false with dl->error set if the dir cant be opened,
+caller warns so parallel -R can report in output order*/
+bool read_directory(const char *path, const struct options *opts, struct dir_listing *dl){
+	return read_directory_at(AT_FDCWD, path, path, opts, false, dl);
+}
+
+/*read dir name, relative to directory fd atfd, into dl.
+path is only used for messages and must name the same dir.
+entries are stat'd relative to the dir fd, so no full paths are built.
+keep_fd leaves an fd for the dir in dl->fd so -R can openat subdirs*/
+bool read_directory_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool keep_fd, struct dir_listing *dl){
+	struct dents d;
+	struct listing_scan scan;
+	struct stat_failed sf;
+	int fd;
+	int error;
+	struct meta_plan plan;
+	struct cache_key key;
+	bool cacheable;
+	uint64_t t;
+
+	dl->files = NULL;
+	dl->count = 0;
+	dl->total_blocks = 0;
+	dl->total_size_bytes = 0;
+	dl->error = 0;
+	dl->fd = -1;
+	arena_init(&dl->names);
+	dl->subdirs = NULL;
+	dl->nsubdirs = 0;
+	dl->path = path;
+	dl->map = NULL;
+	dl->map_len = 0;
+	(void)memset(&dl->du, 0, sizeof(dl->du));
+	dl->du_links = NULL;
+	dl->ndu_links = 0;
+
+	t = stats_now();
+	if ((fd = openat(atfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		dl->error = errno;
+		return false;
+	}
+	if (keep_fd && (dl->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		dl->error = errno;
+		(void)close(fd);
+		return false;
+	}
+	stats_add(STATS_DIRS, 1);
+
+	/*what each entry needs, d_type/d_ino often spare the stat*/
+	meta_plan(opts, &plan);
+
+	/*--head/--tail keep a bounded heap instead, see topk.c*/
+	if (opts->head > 0 || opts->tail > 0) {
+		if (!dents_open(&d, fd, NULL, opts)) {
+			goto fail;
 		}
+		read_topk(&d, fd, path, opts, &plan, dl);
+		dents_close(&d);
+		(void)close(fd);
+		return true;
+	}
 
-		/*get file stats if needed*/
-		if ((opts->long_format)||(opts->numeric_ids)||(opts->blocks)||(opts->classify)||(opts->inode)||(opts->sort_time)||(opts->sort_size)) {
-			fullpath = build_path(path, entry->d_name);
-			if (fullpath == NULL) {
-				err(1, NULL);
-			}
-			if (lstat(fullpath, &files[count].sb) < 0) {
-				warn("cannot stat '%s'", fullpath);
-				free(fullpath);
-				free(files[count].name);
-				continue;
-			}
-			free(fullpath);
-			//Acc logical file sizes in bytes
-			total_size_bytes += files[count].sb.st_size;
-			total_blocks += files[count].sb.st_blocks;
+	/*--cache, the last run's listing if the dir is as it was*/
+	cacheable = opts->cache_dir != NULL && cache_key_at(fd, opts, &plan, &key);
+	if (cacheable && cache_load(&key, dl)) {
+		if (opts->du) {
+			du_count(fd, dl->files, dl->count, dl);
 		}
-		count++;
+		stats_add(STATS_CACHE_HITS, 1);
+		stats_time(STATS_READ, t, path);
+		stats_peak(dl->count);
+		(void)close(fd);
+		return true;
+	}
+
+	/*names stay in the getdents buffers, which the arena keeps*/
+	if (!dents_open(&d, fd, &dl->names, opts)) {
+		goto fail;
+	}
+	error = listing_names(&d, &plan, &scan);
+	stats_add(STATS_ENTRIES, d.nread);
+	dents_close(&d);
+	if (error != 0) {
+		errno = error;
+		err(1, NULL);
+	}
+	stats_time(STATS_READ, t, path);
+
+	/*the rest of the metadata, see listing.c*/
+	t = stats_now();
+	stats_add(STATS_STATS, scan.npending);
+	sf.path = path;
+	sf.cacheable = &cacheable;
+	if ((error = listing_stat(fd, opts, &plan, &scan, dl, warn_stat, &sf)) != 0) {
+		errno = error;
+		err(1, NULL);
+	}
+	stats_add(STATS_READLINKS, scan.nlinks);
+	if (opts->du) {
+		du_count(fd, scan.files, scan.count, dl);
+	}
+	/*only what was read from an unchanging dir is stored*/
+	cacheable = cacheable && key.settled && cache_key_same(fd, &key);
+	(void)close(fd);
+	stats_time(STATS_STAT, t, path);
+
+	t = stats_now();
+	sort_entries(scan.files, scan.count, opts);
+	stats_time(STATS_SORT, t, path);
+	stats_peak(scan.count);
+	dl->files = scan.files;
+	dl->count = scan.count;
+	if (cacheable) {
+		cache_store(&key, dl);
+	}
+	return true;
+
+fail:
+	dl->error = d.error;
+	if (dl->fd >= 0) {
+		(void)close(dl->fd);
+		dl->fd = -1;
+	}
+	(void)close(fd);
+	return false;
+}
+
+/*listing_stat callback: warn, and a listing with holes isnt worth
+keeping in the cache*/
+static void warn_stat(void *arg, const char *name, int error){
+	struct stat_failed *sf = arg;
+
+	*sf->cacheable = false;
+	errno = error;
+	out_warn("cannot stat '%s%s%s'", sf->path,
+	    sf->path[strlen(sf->path) - 1] == '/' ? "" : "/", name);
+}
+
+/*print a listing read by read_directory*/
+void print_directory(const struct dir_listing *dl, const struct options *opts){
+	uint64_t t;
+
+	t = stats_format_start();
+
+	/*where ls streams (stream.c) the total can only come last, so
+	listings read whole for -j or --watch put it there too*/
+	if (stream_enabled(opts)) {
+		print_files(dl->files, dl->count, dl->path, opts);
+		print_total(dl->total_blocks, dl->total_size_bytes, opts);
+		stats_time(STATS_FORMAT, t, dl->path);
+		return;
 	}
-	//printf("en %luK\n", total_size_bytes);
-	closedir(dir);
 	/*print total count on top*/
+	print_total(dl->total_blocks, dl->total_size_bytes, opts);
+	/*display files*/
+	print_files(dl->files, dl->count, dl->path, opts);
+	stats_time(STATS_FORMAT, t, dl->path);
+}
+
+/*total line for -l -n -s, blocks in 512-byte units*/
+void print_total(uint64_t blocks, uint64_t bytes, const struct options *opts){
+	if (opts->no_total || opts->json) {
+		return;
+	}
 	if ((opts->long_format)||(opts->numeric_ids)||((opts->blocks))) {
 		if (opts->human_readable) {
 			// Convert to kilobytes, rounding up
-			uint64_t total_kb = (total_size_bytes + 1023) / 1024;
-    		printf("total %luK\n", total_kb);
+			uint64_t total_kb = (bytes + 1023) / 1024;
+    		out_str("total ");
+			out_uint(total_kb, 0);
+			out_str("K");
+			out_eol();
 		} else if (opts->kilobytes) {
-			//char buf[16];
 			// total_blocks is in 512-byte units, convert to bytes
-			printf("total %lu\n", (total_blocks + 1) / 2); 
+			out_str("total ");
+			out_uint((blocks + 1) / 2, 0);
+			out_eol();
 		} else {
 			// Default: show raw 512-byte block count
-			printf("total %lu\n", total_blocks);
+			out_str("total ");
+			out_uint(blocks, 0);
+			out_eol();
 		}
 	}
-	/* HERE IS WHERE IMPLEMENTED SORTING STUFF, WONT MESS WITH OTHER FLAGS!! */
-	if (!opts->unsorted) {
-		if (opts->sort_time) {
-			if(opts->use_atime){
-			qsort(files, count, sizeof(struct file_entry), compare_timea);
-			}
-			else if(opts->use_ctime){
-				qsort(files, count, sizeof(struct file_entry), compare_timec);
-			}
-			else {
-				qsort(files, count, sizeof(struct file_entry), compare_timem);
-			}
-		} 
-		else if (opts->sort_size) {
-			qsort(files, count, sizeof(struct file_entry), compare_size);
-		} 
-		else {
-			qsort(files, count, sizeof(struct file_entry), compare_names);
-		}
-		
-		/* Reverse if -r flag */
-		if (opts->reverse) {
-			reverse_entries(files, count);
-		}
+}
+
+/*free names and array of a listing*/
+void free_listing(struct dir_listing *dl){
+	arena_free(&dl->names);
+	cache_release(dl);
+	lib_free(dl->files);
+	dl->files = NULL;
+	dl->count = 0;
+	lib_free(dl->subdirs);
+	dl->subdirs = NULL;
+	dl->nsubdirs = 0;
+	free(dl->du_links);
+	dl->du_links = NULL;
+	dl->ndu_links = 0;
+	if (dl->fd >= 0) {
+		(void)close(dl->fd);
+		dl->fd = -1;
 	}
-	/*display files*/
-	if ((opts->long_format)||(opts->numeric_ids)) {
-		/*long -l or n, one file per line with details*/
-		for (i = 0; i < count; i++) {
-			print_long_format(files[i].name, &files[i].sb, opts);
+}
+
+/*list contents of a dir*/
+void ls_directory(const char *path, const struct options *opts){
+	struct dir_listing dl;
+
+	if (stream_enabled(opts)) {
+		if (!stream_directory_at(AT_FDCWD, path, path, opts, false, &dl)) {
+			errno = dl.error;
+			out_warn("cannot access '%s'", path);
+			return;
 		}
-	} else {
-		/*simple form with columns*/
-		print_columns(files, count, opts);
+		free_listing(&dl);
+		return;
 	}
-
-	for (i = 0; i < count; i++) {
-		free(files[i].name);
+	if (!read_directory(path, opts, &dl)) {
+		errno = dl.error;
+		out_warn("cannot access '%s'", path);
+		return;
 	}
-	free(files);
+	print_directory(&dl, opts);
+	free_listing(&dl);
 }
+
 /*process directory recursively.
 lists current directory, then recurses into subdirectories.*/
 void process_recursively(const char *path, const struct options *opts, bool print_name) {
-	DIR *dir;
-	struct dirent *entry;
-	struct file_entry *subdirs;
+	recurse_at(AT_FDCWD, path, path, opts, print_name, 0);
+}
+
+/*-R worker for process_recursively. the listing is read once,
+subdirs are picked out of it after printing and opened relative to
+its fd, so the kernel never walks the full path. depth is how far
+below the operand it is*/
+static void recurse_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool print_name, int depth) {
+	struct dir_listing dl;
+	struct arena subdir_names;
 	char *fullpath;
-	struct stat sb;
-	int capacity;
 	int count;
 	int i;
 
-	/*directory name if*/
-	if (print_name) {
-		(void)printf("%s:\n", path);
+	/*directory name if, --json has full paths instead*/
+	if (print_name && !opts->json) {
+		out_str(path);
+		out_char(':');
+		out_eol();
 	}
-	/*current directory listed by ls_directory */
-	ls_directory(path, opts);
-
-	/*collect subdirs for recursion*/
-	if ((dir = opendir(path)) == NULL) {
-		warn("cannot access '%s'", path);
-		return;
+	if (!list_at(atfd, name, path, opts, &dl)) {
+		/*out of fds on a very deep tree, fall back to the path*/
+		if (dl.error != EMFILE || atfd == AT_FDCWD ||
+		    !list_at(AT_FDCWD, path, path, opts, &dl)) {
+			errno = dl.error;
+			out_warn("cannot access '%s'", path);
+			return;
+		}
 	}
 
-	/*array for subdir entries*/
-	capacity = 16;
-	count = 0;
-	if ((subdirs = malloc(capacity * sizeof(struct file_entry))) == NULL) {
-		err(1, NULL);
+	/*streamed and --head/--tail listings have their subdirs apart*/
+	if (dl.subdirs != NULL || dl.files == NULL) {
+		lib_free(dl.files);
+		dl.files = dl.subdirs;
+		dl.count = dl.nsubdirs;
+		dl.subdirs = NULL;
+		dl.nsubdirs = 0;
 	}
 
-	/*read directory and collect subdirectories*/
-	while ((entry = readdir(dir)) != NULL) {
-		/* Skip . and .. */
-		if (strcmp(entry->d_name, ".") == 0 || 
-		    strcmp(entry->d_name, "..") == 0) {
-			continue;
-		}
-
-		/*skip hidden files unless -a */
-		if (!opts->show_all && entry->d_name[0] == '.') {
+	/*keep only subdirs, already in sort_entries order. their names
+	move to a small arena so the big one is freed before recursing.
+	none past --max-depth, those are never opened*/
+	arena_init(&subdir_names);
+	count = 0;
+	for (i = 0; i < dl.count && is_within_depth(depth + 1, opts); i++) {
+		if (!is_recurse_dir(&dl.files[i], opts)) {
 			continue;
 		}
-		fullpath = build_path(path, entry->d_name);
-		if (fullpath == NULL) {
+		dl.files[count] = dl.files[i];
+		if ((dl.files[count].name = arena_strdup(&subdir_names, dl.files[i].name)) == NULL) {
 			err(1, NULL);
 		}
+		dl.files[count].link = NULL;
+		count++;
+	}
+	arena_free(&dl.names);
+	cache_release(&dl);
+	dl.names = subdir_names;
+	dl.count = count;
 
-		if (lstat(fullpath, &sb) < 0) {
-			warn("cannot stat '%s'", fullpath);
-			free(fullpath);
-			continue;
-		}
-
-		/*skip sym links*/
-		if (S_ISLNK(sb.st_mode)) {
-			free(fullpath);
-			continue;
+	/*recurse subdirs in order */
+	for (i = 0; i < dl.count; i++) {
+		if ((fullpath = build_path(path, dl.files[i].name)) == NULL) {
+			err(1, NULL);
 		}
-
-		if (S_ISDIR(sb.st_mode)) {
-			if (count >= capacity) {
-				struct file_entry *new_subdirs;
-
-				capacity *= 2;
-				new_subdirs = realloc(subdirs, 
-				    capacity * sizeof(struct file_entry));
-				if (new_subdirs == NULL) {
-					err(1, NULL);
-				}
-				subdirs = new_subdirs;
-			}
-
-			subdirs[count].name = fullpath;
-			subdirs[count].sb = sb;
-			count++;
-		} else {
-			free(fullpath);
+		if (!opts->json) {
+			out_eol();
 		}
+		recurse_at(dl.fd, dl.files[i].name, fullpath, opts, true, depth + 1);
+		free(fullpath);
 	}
+	free_listing(&dl);
+}
 
-	closedir(dir);
-
-	/*subdirs sorted according to flags*/
-	sort_entries(subdirs, count, opts);
-
-	/*recurse subdirs in order */
-	for (i = 0; i < count; i++) {
-		(void)printf("\n");
-		process_recursively(subdirs[i].name, opts, true);
-		free(subdirs[i].name);
+/*print the dir for recurse_at and leave its fd and at least its
+subdirs in dl. streams when it can, else reads it whole*/
+static bool list_at(int atfd, const char *name, const char *path,
+    const struct options *opts, struct dir_listing *dl){
+	if (stream_enabled(opts)) {
+		return stream_directory_at(atfd, name, path, opts, true, dl);
 	}
-
-	free(subdirs);
+	if (!read_directory_at(atfd, name, path, opts, true, dl)) {
+		return false;
+	}
+	print_directory(dl, opts);
+	return true;
 }
 
 /*list a single file*/
 void ls_file(const char *path, const struct options *opts) {
-	struct stat sb;
-	if (lstat(path, &sb) < 0) {
-		warn("cannot access '%s'", path);
+	struct meta_plan plan;
+	struct entry_meta m;
+	struct arena a;
+	char *link;
+	uint64_t t;
+
+	meta_plan(opts, &plan);
+	t = stats_now();
+	stats_add(STATS_STATS, 1);
+	if (meta_stat_at(AT_FDCWD, path, &plan, &m) < 0) {
+		out_warn("cannot access '%s'", path);
 		return;
 	}
-	if ((opts->long_format)||(opts->numeric_ids)) {
-		print_long_format(path, &sb, opts);
+	stats_time(STATS_STAT, t, path);
+	if (wants_link(opts)) {
+		arena_init(&a);
+		link = NULL;
+		if (S_ISLNK(m.mode)) {
+			stats_add(STATS_READLINKS, 1);
+			link = read_link_at(AT_FDCWD, path, &a);
+		}
+		if (opts->json) {
+			print_json(NULL, path, &m, link, opts);
+		} else {
+			print_long_format(path, &m, link, opts);
+		}
+		arena_free(&a);
 	} else {
 		print_simple(path);
 	}
 }
-
-static void usage(void){
-	(void)fprintf(stderr, "usage: ls [-al] [file ...]\n");
-	exit(EXIT_FAILURE);
-}
\ No newline at end of file
@@ -9,6 +9,10 @@
 #include <dirent.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+struct filter;
+struct outctx;
 
 /*command line options*/
 struct options {
@@ -30,39 +34,380 @@ struct options {
     bool blocks;            /* -s */
     bool dir_as_file;       /* -d */
     bool printable_only;    /* -q */
+    int jobs;               /* -j worker threads for -R */
+    bool no_sync;           /* --no-sync cached attributes are fine */
+    bool uring;             /* --uring batch stats through io_uring */
+    bool one_per_line;      /* -1 */
+    bool no_total;          /* --no-total no total line */
+    int head;               /* --head N only the first N, 0 for all */
+    int tail;               /* --tail N only the last N, 0 for all */
+    bool stats;             /* --stats summary on stderr */
+    const char *stats_trace; /* --stats-trace FILE chrome trace, or NULL */
+    bool zero;              /* --zero lines end in nul, names raw */
+    bool json;              /* --json an object per entry */
+    const char *cache_dir;  /* --cache DIR listings kept there, or NULL */
+    bool watch;             /* --watch list again on every change */
+    bool du;                /* --du subtree totals per dir */
+    size_t getdents_buf;    /* --getdents-buf biggest read buffer */
+    struct filter *filter;  /* --include/--exclude globs, or NULL */
+    int max_depth;          /* --max-depth N levels -R goes down, -1 for all */
+    const char *serve;      /* --serve SOCKET run as a daemon there, or NULL */
+    const char *client;     /* --client SOCKET have that daemon list, or NULL */
+};
+
+/*metadata an entry needs, see meta_plan*/
+#define META_TYPE	0x01	/* file type, d_type will do */
+#define META_INO	0x02	/* inode number, d_ino will do */
+#define META_EXEC	0x04	/* exec bits of regular files, for -F */
+#define META_STAT	0x08	/* full stat, nothing else will do */
+
+/*how to get entry metadata for a set of options*/
+struct meta_plan {
+	unsigned int need;	/* META_* */
+	unsigned int mask;	/* statx fields to ask for */
+	bool no_sync;		/* AT_STATX_DONT_SYNC */
+	bool uring;		/* try io_uring for big batches */
+	int time_kind;		/* TIME_* */
+};
+
+/*default and bounds for --getdents-buf*/
+#define GETDENTS_BUF	(1024 * 1024)
+#define GETDENTS_BUF_MIN	(64 * 1024)
+#define GETDENTS_BUF_MAX	(64 * 1024 * 1024)
+
+/*filter_name results*/
+#define FILTER_LIST	0
+#define FILTER_DROP	1
+#define FILTER_DIR	2	/* only matched by no --include, kept if a dir for -R */
+
+/*fewest stats worth handing to io_uring*/
+#define URING_MIN_BATCH	64
+
+/*width of the long format time column*/
+#define TIME_COLUMN_LEN	12
+
+/*entries read, stat'd and printed at a time when streaming*/
+#define STREAM_BATCH	1024
+
+/*entries from which sort_entries uses the radix sort in sort.c*/
+#define SORT_KEYED_MIN	256
+
+/*upper bound for -j*/
+#define MAX_JOBS 256
+
+/*parse_options_msg results, and room for its message*/
+#define PARSE_OK	0
+#define PARSE_ERROR	1	/* msg is for errx */
+#define PARSE_USAGE	2	/* msg goes to stderr as is */
+#define PARSE_MSG_LEN	1024
+
+/*which timestamp -l shows and -t sorts by*/
+#define TIME_MTIME	0
+#define TIME_ATIME	1	/* -u */
+#define TIME_CTIME	2	/* -c */
+
+/*--stats counters*/
+#define STATS_DIRS	0
+#define STATS_ENTRIES	1	/* returned by readdir */
+#define STATS_STATS	2
+#define STATS_READLINKS	3
+#define STATS_PWLOOKUPS	4	/* getpwuid calls and getpwent passes */
+#define STATS_GRLOOKUPS	5
+#define STATS_CACHE_HITS	6	/* listings served by --cache */
+#define STATS_NCOUNTERS	7
+
+/*--stats phases*/
+#define STATS_READ	0
+#define STATS_STAT	1	/* stat and readlink */
+#define STATS_SORT	2
+#define STATS_FORMAT	3
+#define STATS_WRITE	4
+#define STATS_NPHASES	5
+
+/*the stat fields ls uses, a third of a struct stat*/
+struct entry_meta {
+	uint64_t ino;
+	int64_t size;
+	int64_t blocks;		/* 512-byte units */
+	int64_t time;		/* mtime, atime or ctime per TIME_* */
+	mode_t mode;
+	uint32_t nlink;
+	uid_t uid;
+	gid_t gid;
 };
 
-/*file entry for storing directory contents*/
+/*file entry for storing directory contents.
+name and link point into the listing's arena*/
 struct file_entry {
 	char *name;
-	struct stat sb;
+	char *link;		/* symlink target for -l/-n, or NULL */
+	struct entry_meta m;
+};
+
+/*one name_scan pass over a name*/
+struct name_info {
+	size_t len;		/* bytes */
+	size_t width;		/* columns when printed raw */
+	bool clean;		/* printable ascii only, -q leaves it alone */
+};
+
+/*bump allocator, everything freed at once*/
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *chunks;
+	char *ptr;
+	size_t left;
+};
+
+/*--du sums, of one listing or a whole subtree*/
+struct du_total {
+	uint64_t blocks;	/* 512-byte units, hard links once */
+	uint64_t bytes;
+	uint64_t entries;
+};
+
+/*a file with more than one link, for --du to count once*/
+struct du_link {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t blocks;
+	uint64_t bytes;
+};
+
+/*a directory being read, see dents.c*/
+struct dents {
+	int fd;
+	struct arena *keep;	/* buffers come from here, or NULL */
+	const struct options *opts;
+	char *buf;
+	size_t size;
+	size_t len;		/* filled by the last getdents64 */
+	size_t pos;
+	DIR *dir;		/* readdir where getdents64 wont do */
+	uint64_t nread;		/* records seen, listed or not */
+	int error;
+};
+
+/*one directory read, entries sorted and ready to print*/
+struct dir_listing {
+	struct file_entry *files;
+	int count;
+	uint64_t total_blocks;
+	uint64_t total_size_bytes;
+	int error;		/* errno if the dir could not be opened */
+	int fd;			/* dir fd if asked to keep it, else -1 */
+	struct arena names;	/* names and link targets */
+	struct file_entry *subdirs;	/* for -R when files isnt all of them */
+	int nsubdirs;
+	const char *path;	/* the reader's, for messages and --stats */
+	void *map;		/* --cache file the entries point into */
+	size_t map_len;
+	struct du_total du;	/* --du, this level only */
+	struct du_link *du_links;	/* --du, linked files du_credit adds */
+	size_t ndu_links;
+};
+
+/*a directory between its read and stat passes, see listing.c*/
+struct listing_scan {
+	struct file_entry *files;
+	int count;
+	int capacity;
+	int *pending;		/* entries the dirent could not fill */
+	int npending;
+	int pending_cap;
+	uint64_t nlinks;	/* link targets read */
+};
+
+/*what a --cache file is valid for, see cache.c*/
+struct cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint64_t sig;		/* options that change the listing */
+	bool settled;		/* dir unchanged long enough to store */
 };
 
 /*declarations from ls.c*/
+void parse_options(int argc, char *argv[], struct options *opts);
+int parse_options_msg(int argc, char *argv[], struct options *opts, char *msg, size_t len);
+void list_operands(char *const paths[], int n, const struct options *opts);
 void ls_directory(const char *path, const struct options *opts);
 void ls_file(const char *path, const struct options *opts);
 void process_recursively(const char *path, const struct options *opts, bool print_name);
+bool read_directory(const char *path, const struct options *opts, struct dir_listing *dl);
+bool read_directory_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool keep_fd, struct dir_listing *dl);
+void print_directory(const struct dir_listing *dl, const struct options *opts);
+void print_total(uint64_t blocks, uint64_t bytes, const struct options *opts);
+void free_listing(struct dir_listing *dl);
+
+/*declarations from listing.c*/
+int listing_names(struct dents *d, const struct meta_plan *mp, struct listing_scan *s);
+int listing_stat(int fd, const struct options *opts, const struct meta_plan *mp,
+    struct listing_scan *s, struct dir_listing *dl,
+    void (*bad)(void *arg, const char *name, int error), void *arg);
+bool is_listed_name(const char *name, const struct options *opts);
+bool is_recurse_dir(const struct file_entry *fe, const struct options *opts);
+bool is_within_depth(int depth, const struct options *opts);
+
+/*declarations from libls.c*/
+void *lib_malloc(size_t size);
+void *lib_realloc(void *p, size_t size);
+void lib_free(void *p);
+
+/*declarations from meta.c*/
+void meta_plan(const struct options *opts, struct meta_plan *mp);
+bool wants_link(const struct options *opts);
+bool meta_from_dirent(const struct meta_plan *mp, const struct dirent *de, struct entry_meta *m);
+int meta_stat_at(int fd, const char *name, const struct meta_plan *mp, struct entry_meta *m);
+void meta_from_stat(const struct stat *sb, const struct meta_plan *mp, struct entry_meta *m);
+void meta_stat_batch(int fd, struct file_entry *files, const int *idx, int n,
+    const struct meta_plan *mp, int *errs);
+#ifdef STATX_BASIC_STATS
+void meta_from_statx(const struct statx *stx, const struct meta_plan *mp, struct entry_meta *m);
+#endif
+
+/*declarations from uring.c*/
+bool uring_stat_batch(int fd, struct file_entry *files, const int *idx, int n,
+    const struct meta_plan *mp, int *errs);
+
+/*declarations from idcache.c*/
+const char *user_name(uid_t uid);
+const char *group_name(gid_t gid);
+void idcache_prime(const struct file_entry *files, int count);
+void idcache_share(void);
+
+/*declarations from timefmt.c*/
+const char *format_time(time_t t);
+void format_time_now(void);
+
+/*declarations from sort.c*/
+bool sort_entries_keyed(struct file_entry *entries, int count, const struct options *opts);
+
+/*declarations from stream.c*/
+bool stream_enabled(const struct options *opts);
+bool stream_directory_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool keep_fd, struct dir_listing *dl);
+void keep_subdir(struct dir_listing *dl, const struct file_entry *fe);
+
+/*declarations from topk.c*/
+void read_topk(struct dents *d, int fd, const char *path, const struct options *opts,
+    const struct meta_plan *mp, struct dir_listing *dl);
+
+/*declarations from stats.c*/
+extern bool stats_enabled;
+void stats_init(const char *path);
+uint64_t stats_now(void);
+uint64_t stats_format_start(void);
+void stats_time(int phase, uint64_t start, const char *dir);
+void stats_add(int counter, uint64_t n);
+void stats_peak(uint64_t n);
+void stats_report(void);
+
+/*declarations from cache.c*/
+bool cache_init(const char *dir);
+bool cache_key_at(int fd, const struct options *opts, const struct meta_plan *mp,
+    struct cache_key *key);
+bool cache_key_same(int fd, const struct cache_key *key);
+bool cache_load(const struct cache_key *key, struct dir_listing *dl);
+void cache_store(const struct cache_key *key, const struct dir_listing *dl);
+void cache_release(struct dir_listing *dl);
+
+/*declarations from dents.c*/
+bool dents_open(struct dents *d, int fd, struct arena *keep, const struct options *opts);
+struct dirent *dents_next(struct dents *d);
+char *dents_name(struct dents *d, struct dirent *de);
+void dents_close(struct dents *d);
+
+/*declarations from filter.c*/
+bool filter_add(struct options *opts, const char *glob, bool include);
+void filter_free(struct filter *f);
+int filter_name(const struct filter *f, const char *name);
+uint64_t filter_sig(const struct filter *f);
+
+/*declarations from du.c*/
+void du_count(int fd, const struct file_entry *files, int count, struct dir_listing *dl);
+void du_credit(struct dir_listing *dl);
+void du_reset(void);
+
+/*declarations from watch.c*/
+void watch_run(char *const paths[], int n, const struct options *opts);
+
+/*declarations from serve.c*/
+int serve_run(const char *path, const struct options *opts);
+bool client_run(const char *path, int argc, char *argv[], const struct options *opts,
+    int *status);
+
+/*declarations from operands.c*/
+void stat_operands(char *const paths[], int n, const struct options *opts,
+    struct file_entry *files, bool *dirs, int *errs);
+
+/*declarations from walk.c*/
+void process_recursively_parallel(const char *path, const struct options *opts, bool print_name);
+
+/*declarations from outbuf.c*/
+void out_flush(void);
+void out_char(char c);
+void out_mem(const char *p, size_t n);
+void out_str(const char *s);
+void out_pad(int n);
+void out_str_left(const char *s, int width);
+void out_uint(uint64_t v, int width);
+void out_int(int64_t v, int width);
+void out_mode(mode_t mode);
+void out_set_eol(char c);
+void out_eol(void);
+void out_json_chars(const char *s, size_t n);
+void out_json_str(const char *s);
+struct outctx *out_new(void);
+void out_open(struct outctx *o, int fd, int err_fd, int conn);
+int out_close(void);
+struct outctx *out_current(void);
+void out_use(struct outctx *o);
+int out_fd(void);
+void out_warn(const char *fmt, ...);
 
 /*declarations from print.c*/
-void print_filename_sanitized(const char *name);
-void print_suffix(const struct stat *sb);
-void print_size_column(const struct stat *sb, const struct options *opts);
-void print_size_long(const struct stat *sb, const struct options *opts);
-void print_long_format(const char *name, const struct stat *sb, const struct options *opts);
+void print_name(const char *name, const struct name_info *ni, const struct options *opts);
+void print_suffix(const struct entry_meta *m);
+void print_size_column(const struct entry_meta *m, const struct options *opts);
+void print_size_long(const struct entry_meta *m, const struct options *opts);
+void print_long_format(const char *name, const struct entry_meta *m, const char *link, const struct options *opts);
 void print_simple(const char *name);
 void print_columns(struct file_entry *entries, int count, const struct options *opts);
+void print_json(const char *dir, const char *name, const struct entry_meta *m,
+    const char *link, const struct options *opts);
+void print_files(struct file_entry *files, int count, const char *dir, const struct options *opts);
+void print_du(const char *path, const struct du_total *du, const struct options *opts);
+
+/*declarations from scan.c*/
+void name_scan(const char *s, struct name_info *ni);
 
 /*declarations from util.c*/
-int compare_timem(const void *a, const void *b);
-int compare_timea(const void *a, const void *b);
-int compare_timec(const void *a, const void *b);
+int compare_time(const void *a, const void *b);
 int compare_size(const void *a, const void *b);
 void reverse_entries(struct file_entry *entries, int count);
 bool is_directory(const char *path);
 char *build_path(const char *dir, const char *file);
+char *read_link_at(int fd, const char *name, struct arena *a);
 int compare_names(const void *a, const void *b);
-uint64_t get_display_block_size(const struct stat *sb, const struct options *opts);
+uint64_t get_display_block_size(const struct entry_meta *m, const struct options *opts);
 const char *format_size(uint64_t bytes, char *buf, size_t buflen);
 void sort_entries(struct file_entry *entries, int count, const struct options *opts);
+void arena_init(struct arena *a);
+char *arena_strdup(struct arena *a, const char *s);
+void *arena_alloc(struct arena *a, size_t size);
+size_t arena_avail(const struct arena *a);
+void arena_trim(struct arena *a, void *p, size_t size, size_t used);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
 
 #endif /* !_LS_H_ */
\ No newline at end of file
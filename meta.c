@@ -0,0 +1,217 @@
+/*meta.c - work out how much metadata entries need, and fetch it*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ls.h"
+
+#ifdef STATX_BASIC_STATS
+/*set once statx turns out to be missing (old kernel, seccomp)*/
+static volatile sig_atomic_t no_statx;
+#endif
+
+/*minimum metadata needed for the options given.
+-l -n -s -t -S and totals need a real stat, -R only needs the type,
+-i only the inode number, -F the type plus exec bits of regular files.
+for the stat, mask says which fields are actually read*/
+void meta_plan(const struct options *opts, struct meta_plan *mp){
+	unsigned int mask = 0;
+	unsigned int need = 0;
+
+	if ((opts->long_format)||(opts->numeric_ids)||(opts->blocks)||(opts->sort_time)||(opts->sort_size)||(opts->json)||(opts->du)) {
+		need = META_STAT;
+	}
+	if (opts->recursive) {
+		need |= META_TYPE;
+	}
+	if (opts->classify) {
+		need |= META_TYPE | META_EXEC;
+	}
+	if (opts->inode) {
+		need |= META_INO;
+	}
+
+#ifdef STATX_BASIC_STATS
+	/*type and mode come with the inode, always ask*/
+	mask = STATX_TYPE | STATX_MODE;
+	if (opts->inode) {
+		mask |= STATX_INO;
+	}
+	if ((opts->long_format)||(opts->numeric_ids)||(opts->json)) {
+		mask |= STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_BLOCKS;
+	}
+	/*--json has every field*/
+	if (opts->json) {
+		mask |= STATX_INO;
+	}
+	/*--du adds sizes and needs links by inode*/
+	if (opts->du) {
+		mask |= STATX_INO | STATX_NLINK | STATX_SIZE | STATX_BLOCKS;
+	}
+	/*-s and the total line, -h totals count bytes*/
+	if (opts->blocks) {
+		mask |= STATX_BLOCKS;
+		if (opts->human_readable) {
+			mask |= STATX_SIZE;
+		}
+	}
+	if (opts->sort_size) {
+		mask |= STATX_SIZE;
+	}
+	/*one timestamp, for -t and the -l time column*/
+	if ((opts->sort_time)||(opts->long_format)||(opts->numeric_ids)||(opts->json)) {
+		if (opts->use_atime) {
+			mask |= STATX_ATIME;
+		} else if (opts->use_ctime) {
+			mask |= STATX_CTIME;
+		} else {
+			mask |= STATX_MTIME;
+		}
+	}
+#endif
+	mp->need = need;
+	mp->mask = mask;
+	mp->no_sync = opts->no_sync;
+	mp->uring = opts->uring;
+	if (opts->use_atime) {
+		mp->time_kind = TIME_ATIME;
+	} else if (opts->use_ctime) {
+		mp->time_kind = TIME_CTIME;
+	} else {
+		mp->time_kind = TIME_MTIME;
+	}
+}
+
+/*true if readers should fetch symlink targets*/
+bool wants_link(const struct options *opts){
+	return (opts->long_format)||(opts->numeric_ids)||(opts->json);
+}
+
+/*fill what the plan needs from the dirent alone.
+returns true if sb is good enough, false if the entry must be stat'd*/
+bool meta_from_dirent(const struct meta_plan *mp, const struct dirent *de, struct entry_meta *m){
+	if (mp->need & META_STAT) {
+		return false;
+	}
+	(void)memset(m, 0, sizeof(*m));
+	m->ino = de->d_ino;
+	if (!(mp->need & (META_TYPE | META_EXEC))) {
+		return true;
+	}
+#ifdef DT_UNKNOWN
+	/*some filesystems dont fill d_type*/
+	if (de->d_type == DT_UNKNOWN) {
+		return false;
+	}
+	/*-F marks executables, only the mode bits know that*/
+	if ((mp->need & META_EXEC) && de->d_type == DT_REG) {
+		return false;
+	}
+	m->mode = DTTOIF(de->d_type);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*lstat name relative to fd, fetching only the fields in the plan.
+uses statx where there is one, fields not asked for are zero*/
+int meta_stat_at(int fd, const char *name, const struct meta_plan *mp, struct entry_meta *m){
+	struct stat sb;
+#ifdef STATX_BASIC_STATS
+	struct statx stx;
+	int flags;
+
+	if (!no_statx) {
+		flags = AT_SYMLINK_NOFOLLOW;
+		if (mp->no_sync) {
+			/*take cached attributes, dont revalidate over the network*/
+			flags |= AT_STATX_DONT_SYNC;
+		}
+		if (statx(fd, name, flags, mp->mask, &stx) == 0) {
+			meta_from_statx(&stx, mp, m);
+			return 0;
+		}
+		if (errno != ENOSYS && errno != EPERM) {
+			return -1;
+		}
+		no_statx = 1;
+	}
+#endif
+	if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -1;
+	}
+	meta_from_stat(&sb, mp, m);
+	return 0;
+}
+
+/*keep the fields ls uses out of a struct stat*/
+void meta_from_stat(const struct stat *sb, const struct meta_plan *mp, struct entry_meta *m){
+	m->ino = sb->st_ino;
+	m->size = sb->st_size;
+	m->blocks = sb->st_blocks;
+	m->mode = sb->st_mode;
+	m->nlink = sb->st_nlink;
+	m->uid = sb->st_uid;
+	m->gid = sb->st_gid;
+	switch (mp->time_kind) {
+	case TIME_ATIME:
+		m->time = sb->st_atime;
+		break;
+	case TIME_CTIME:
+		m->time = sb->st_ctime;
+		break;
+	default:
+		m->time = sb->st_mtime;
+		break;
+	}
+}
+
+/*stat files[idx[i]] for i < n, relative to fd. errs[i] gets 0 or errno.
+with --uring big batches go through io_uring, else one call each*/
+void meta_stat_batch(int fd, struct file_entry *files, const int *idx, int n,
+    const struct meta_plan *mp, int *errs){
+	int i;
+
+	if (mp->uring && n >= URING_MIN_BATCH &&
+	    uring_stat_batch(fd, files, idx, n, mp, errs)) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		errs[i] = 0;
+		if (meta_stat_at(fd, files[idx[i]].name, mp, &files[idx[i]].m) < 0) {
+			errs[i] = errno;
+		}
+	}
+}
+
+#ifdef STATX_BASIC_STATS
+/*keep the fields ls uses out of a statx, zero where not asked for*/
+void meta_from_statx(const struct statx *stx, const struct meta_plan *mp, struct entry_meta *m){
+	m->ino = stx->stx_ino;
+	m->size = stx->stx_size;
+	m->blocks = stx->stx_blocks;
+	m->mode = stx->stx_mode;
+	m->nlink = stx->stx_nlink;
+	m->uid = stx->stx_uid;
+	m->gid = stx->stx_gid;
+	switch (mp->time_kind) {
+	case TIME_ATIME:
+		m->time = stx->stx_atime.tv_sec;
+		break;
+	case TIME_CTIME:
+		m->time = stx->stx_ctime.tv_sec;
+		break;
+	default:
+		m->time = stx->stx_mtime.tv_sec;
+		break;
+	}
+}
+#endif
@@ -0,0 +1,127 @@
+/*operands.c - stat the command line operands in one batch*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+/*
+ * xargs can hand ls tens of thousands of paths. They are stat'd once
+ * each, lstat as ls_file does, and only symlinks get a second stat to
+ * see if they lead to a directory. Past OPERAND_CHUNK the batch is cut
+ * into slices, one thread each (-j of them, else one per cpu), every
+ * slice going through meta_stat_batch so --uring works here too.
+ * Nothing is printed from the threads, list_operands does the warnings
+ * in argv order afterwards.
+ */
+
+/*fewest operands worth a thread*/
+#define OPERAND_CHUNK	1024
+
+struct operand_slice {
+	pthread_t thread;
+	struct file_entry *files;
+	bool *dirs;
+	int *errs;
+	const int *idx;
+	int n;
+	const struct meta_plan *mp;
+	bool follow;
+};
+
+static void *slice_main(void *arg);
+static void stat_slice(struct operand_slice *s);
+
+/*fill files[i].m for paths[i], errs[i] 0 or errno. dirs[i] is set for
+dirs and, with follow, for symlinks to dirs, whose m is then the dir's*/
+void stat_operands(char *const paths[], int n, const struct options *opts,
+    struct file_entry *files, bool *dirs, int *errs){
+	struct operand_slice *slices;
+	struct meta_plan plan;
+	int *idx;
+	long nslices;
+	int per;
+	int i;
+
+	meta_plan(opts, &plan);
+	if ((idx = malloc((size_t)n * sizeof(int))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < n; i++) {
+		files[i].name = paths[i];
+		files[i].link = NULL;
+		idx[i] = i;
+	}
+	stats_add(STATS_STATS, (uint64_t)n);
+
+	nslices = opts->jobs > 0 ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nslices > n / OPERAND_CHUNK) {
+		nslices = n / OPERAND_CHUNK;
+	}
+	if (nslices < 1) {
+		nslices = 1;
+	} else if (nslices > MAX_JOBS) {
+		nslices = MAX_JOBS;
+	}
+	if ((slices = calloc((size_t)nslices, sizeof(struct operand_slice))) == NULL) {
+		err(1, NULL);
+	}
+	per = (int)(n / nslices);
+	for (i = 0; i < nslices; i++) {
+		slices[i].files = files;
+		slices[i].dirs = dirs + i * per;
+		slices[i].errs = errs + i * per;
+		slices[i].idx = idx + i * per;
+		slices[i].n = i == nslices - 1 ? n - i * per : per;
+		slices[i].mp = &plan;
+		slices[i].follow = !opts->dir_as_file;
+	}
+	/*the caller's thread takes the first slice*/
+	for (i = 1; i < nslices; i++) {
+		if ((errno = pthread_create(&slices[i].thread, NULL, slice_main, &slices[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+	stat_slice(&slices[0]);
+	for (i = 1; i < nslices; i++) {
+		pthread_join(slices[i].thread, NULL);
+	}
+	free(slices);
+	free(idx);
+}
+
+static void *slice_main(void *arg){
+	stat_slice(arg);
+	return NULL;
+}
+
+static void stat_slice(struct operand_slice *s){
+	struct file_entry *fe;
+	struct stat sb;
+	int i;
+
+	meta_stat_batch(AT_FDCWD, s->files, s->idx, s->n, s->mp, s->errs);
+	for (i = 0; i < s->n; i++) {
+		fe = &s->files[s->idx[i]];
+		s->dirs[i] = false;
+		if (s->errs[i] != 0 || !s->follow) {
+			continue;
+		}
+		if (S_ISDIR(fe->m.mode)) {
+			s->dirs[i] = true;
+		} else if (S_ISLNK(fe->m.mode) && stat(fe->name, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+			/*listed as the dir it leads to, sorted by it too*/
+			stats_add(STATS_STATS, 1);
+			meta_from_stat(&sb, s->mp, &fe->m);
+			s->dirs[i] = true;
+		}
+	}
+}
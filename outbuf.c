@@ -0,0 +1,482 @@
+/*outbuf.c - buffered stdout writer for the print layer*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+/*
+ * All listing output goes through one buffer that is handed to write(2)
+ * in OUTBUF_SIZE chunks, numbers and padding are formatted by hand.
+ * On a terminal it flushes at each newline, like line buffered stdio,
+ * so output keeps its place next to warnings on stderr.
+ *
+ * The buffer and where it goes are an outctx. ls has the one for its
+ * stdout; a --serve worker opens its own on a client's stdout and
+ * stderr, so the thread's out_* and out_warn calls go there. A failed
+ * write there drops the rest of the request's output instead of ending
+ * the daemon, and so does a client that hung up.
+ */
+
+#define OUTBUF_SIZE	(256 * 1024)
+
+struct outctx {
+	char *buf;		/* OUTBUF_SIZE */
+	size_t len;
+	int fd;
+	int err_fd;
+	int conn;		/* client socket to watch for hangups, or -1 */
+	int error;		/* errno of the write that failed, 0 */
+	bool line_buffered;
+	bool initialized;
+	/*line terminator, nul for --zero*/
+	char eol;
+};
+
+/*the buffer apart so it is bss, not 256K of zeros in the binary*/
+static char std_buf[OUTBUF_SIZE];
+static struct outctx std_out = { .buf = std_buf, .fd = STDOUT_FILENO,
+	.err_fd = STDERR_FILENO, .conn = -1, .eol = '\n' };
+/*this thread's, NULL for std_out*/
+static __thread struct outctx *cur;
+
+static void out_init(void);
+static size_t utf8_len(const unsigned char *p, const unsigned char *end);
+
+static struct outctx *out_ctx(void){
+	return cur != NULL ? cur : &std_out;
+}
+
+static void out_init(void){
+	std_out.line_buffered = isatty(STDOUT_FILENO);
+	if (atexit(out_flush) != 0) {
+		err(1, "atexit");
+	}
+	std_out.initialized = true;
+}
+
+/*a context for out_open*/
+struct outctx *out_new(void){
+	struct outctx *o;
+
+	if ((o = malloc(sizeof(*o))) == NULL ||
+	    (o->buf = malloc(OUTBUF_SIZE)) == NULL) {
+		err(1, NULL);
+	}
+	o->len = 0;
+	o->initialized = false;
+	return o;
+}
+
+/*send this thread's output to fd and its warnings to err_fd, through o.
+conn, if not -1, is checked at each flush and output stops if it hung up*/
+void out_open(struct outctx *o, int fd, int err_fd, int conn){
+	o->len = 0;
+	o->fd = fd;
+	o->err_fd = err_fd;
+	o->conn = conn;
+	o->error = 0;
+	o->line_buffered = isatty(fd);
+	o->initialized = true;
+	o->eol = '\n';
+	cur = o;
+}
+
+/*flush and go back to stdout. 0, or the errno that stopped the output*/
+int out_close(void){
+	struct outctx *o = out_ctx();
+
+	out_flush();
+	cur = NULL;
+	return o->error;
+}
+
+/*the context of this thread, for threads it starts to out_use*/
+struct outctx *out_current(void){
+	return cur;
+}
+
+/*write to o from this thread too, NULL for stdout*/
+void out_use(struct outctx *o){
+	cur = o;
+}
+
+/*where output goes, for isatty and the terminal width*/
+int out_fd(void){
+	return out_ctx()->fd;
+}
+
+/*write out whatever is buffered*/
+void out_flush(void){
+	struct outctx *o = out_ctx();
+	struct pollfd pfd;
+	size_t off;
+	ssize_t n;
+	uint64_t t;
+
+	t = stats_now();
+	/*a client that is gone wants no more, it only ever reads*/
+	if (o->conn >= 0 && o->error == 0) {
+		pfd.fd = o->conn;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) > 0) {
+			o->error = EPIPE;
+		}
+	}
+	off = 0;
+	while (off < o->len && o->error == 0) {
+		if ((n = write(o->fd, o->buf + off, o->len - off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/*nothing sensible left to do with the output*/
+			o->len = 0;
+			if (o == &std_out) {
+				err(1, "write");
+			}
+			o->error = errno;
+			if (errno != EPIPE) {
+				out_warn("write");
+			}
+			break;
+		}
+		off += (size_t)n;
+	}
+	if (o->len > 0) {
+		stats_time(STATS_WRITE, t, NULL);
+	}
+	o->len = 0;
+}
+
+/*warn(3), to the stderr of this thread's output*/
+void out_warn(const char *fmt, ...){
+	struct outctx *o = out_ctx();
+	va_list ap;
+	char msg[1024];
+	size_t len;
+	int error;
+
+	error = errno;
+	va_start(ap, fmt);
+	if (o == &std_out) {
+		vwarn(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	len = (size_t)snprintf(msg, sizeof(msg), "ls: ");
+	(void)vsnprintf(msg + len, sizeof(msg) - len, fmt, ap);
+	va_end(ap);
+	len = strlen(msg);
+	(void)snprintf(msg + len, sizeof(msg) - len, ": %s\n", strerror(error));
+	/*a long name may have cut it short, it still ends the line*/
+	len = strlen(msg);
+	msg[len - 1] = '\n';
+	while (write(o->err_fd, msg, len) < 0 && errno == EINTR) {
+		continue;
+	}
+}
+
+void out_char(char c){
+	struct outctx *o = out_ctx();
+
+	if (!o->initialized) {
+		out_init();
+	}
+	if (o->len == OUTBUF_SIZE) {
+		out_flush();
+	}
+	o->buf[o->len++] = c;
+	if (c == o->eol && o->line_buffered) {
+		out_flush();
+	}
+}
+
+void out_set_eol(char c){
+	out_ctx()->eol = c;
+}
+
+/*end of a line of listing output*/
+void out_eol(void){
+	out_char(out_ctx()->eol);
+}
+
+void out_mem(const char *p, size_t n){
+	struct outctx *o = out_ctx();
+	size_t chunk;
+
+	if (!o->initialized) {
+		out_init();
+	}
+	while (n > 0) {
+		if (o->len == OUTBUF_SIZE) {
+			out_flush();
+		}
+		chunk = OUTBUF_SIZE - o->len;
+		if (chunk > n) {
+			chunk = n;
+		}
+		(void)memcpy(o->buf + o->len, p, chunk);
+		o->len += chunk;
+		p += chunk;
+		n -= chunk;
+	}
+}
+
+void out_str(const char *s){
+	out_mem(s, strlen(s));
+}
+
+/*n spaces*/
+void out_pad(int n){
+	static const char spaces[] = "                                ";
+
+	while (n > 0) {
+		int chunk = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+		out_mem(spaces, chunk);
+		n -= chunk;
+	}
+}
+
+/*s left aligned in width, like %-*s*/
+void out_str_left(const char *s, int width){
+	size_t len = strlen(s);
+
+	out_mem(s, len);
+	out_pad(width - (int)len);
+}
+
+/*v right aligned in width, like %*llu*/
+void out_uint(uint64_t v, int width){
+	char buf[24];
+	char *p;
+
+	p = buf + sizeof(buf);
+	do {
+		*--p = (char)('0' + v % 10);
+		v /= 10;
+	} while (v != 0);
+	out_pad(width - (int)(buf + sizeof(buf) - p));
+	out_mem(p, buf + sizeof(buf) - p);
+}
+
+/*signed v right aligned in width, like %*lld*/
+void out_int(int64_t v, int width){
+	char buf[24];
+	char *p;
+	uint64_t u;
+
+	u = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+	p = buf + sizeof(buf);
+	do {
+		*--p = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (v < 0) {
+		*--p = '-';
+	}
+	out_pad(width - (int)(buf + sizeof(buf) - p));
+	out_mem(p, buf + sizeof(buf) - p);
+}
+
+/*mode column as strmode(3) writes it: type, nine permission chars
+with setuid/setgid/sticky folded in, then a space*/
+void out_mode(mode_t mode){
+	char buf[11];
+
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		buf[0] = 'd';
+		break;
+	case S_IFCHR:
+		buf[0] = 'c';
+		break;
+	case S_IFBLK:
+		buf[0] = 'b';
+		break;
+	case S_IFLNK:
+		buf[0] = 'l';
+		break;
+	case S_IFSOCK:
+		buf[0] = 's';
+		break;
+	case S_IFIFO:
+		buf[0] = 'p';
+		break;
+#ifdef S_IFWHT
+	case S_IFWHT:
+		buf[0] = 'w';
+		break;
+#endif
+	case S_IFREG:
+		buf[0] = '-';
+		break;
+	default:
+		buf[0] = '?';
+		break;
+	}
+	buf[1] = (mode & S_IRUSR) ? 'r' : '-';
+	buf[2] = (mode & S_IWUSR) ? 'w' : '-';
+	switch (mode & (S_IXUSR | S_ISUID)) {
+	case 0:
+		buf[3] = '-';
+		break;
+	case S_IXUSR:
+		buf[3] = 'x';
+		break;
+	case S_ISUID:
+		buf[3] = 'S';
+		break;
+	default:
+		buf[3] = 's';
+		break;
+	}
+	buf[4] = (mode & S_IRGRP) ? 'r' : '-';
+	buf[5] = (mode & S_IWGRP) ? 'w' : '-';
+	switch (mode & (S_IXGRP | S_ISGID)) {
+	case 0:
+		buf[6] = '-';
+		break;
+	case S_IXGRP:
+		buf[6] = 'x';
+		break;
+	case S_ISGID:
+		buf[6] = 'S';
+		break;
+	default:
+		buf[6] = 's';
+		break;
+	}
+	buf[7] = (mode & S_IROTH) ? 'r' : '-';
+	buf[8] = (mode & S_IWOTH) ? 'w' : '-';
+	switch (mode & (S_IXOTH | S_ISVTX)) {
+	case 0:
+		buf[9] = '-';
+		break;
+	case S_IXOTH:
+		buf[9] = 'x';
+		break;
+	case S_ISVTX:
+		buf[9] = 'T';
+		break;
+	default:
+		buf[9] = 't';
+		break;
+	}
+	buf[10] = ' ';
+	out_mem(buf, sizeof(buf));
+}
+
+/*s[0..n) as the inside of a json string, no quotes. valid utf-8 goes
+through as is, control chars, quote and backslash are escaped, and each
+byte that is not part of valid utf-8 becomes \udc80-\udcff, a lone low
+surrogate (python's surrogateescape), so the exact name can be had back.
+runs of plain bytes are copied in one go, nothing is allocated*/
+void out_json_chars(const char *s, size_t n){
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + n;
+	const unsigned char *run;
+	char esc[6];
+	size_t len;
+
+	while (p < end) {
+		run = p;
+		while (p < end) {
+			if (*p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+				p++;
+			} else if (*p >= 0x80 && (len = utf8_len(p, end)) > 0) {
+				p += len;
+			} else {
+				break;
+			}
+		}
+		if (p > run) {
+			out_mem((const char *)run, (size_t)(p - run));
+		}
+		if (p == end) {
+			break;
+		}
+		esc[0] = '\\';
+		switch (*p) {
+		case '"':
+		case '\\':
+			esc[1] = (char)*p;
+			out_mem(esc, 2);
+			break;
+		case '\n':
+			out_mem("\\n", 2);
+			break;
+		case '\t':
+			out_mem("\\t", 2);
+			break;
+		default:
+			/*\u00XX for control chars, \udcXX for stray bytes*/
+			esc[1] = 'u';
+			esc[2] = *p < 0x80 ? '0' : 'd';
+			esc[3] = *p < 0x80 ? '0' : 'c';
+			esc[4] = hex[*p >> 4];
+			esc[5] = hex[*p & 0xf];
+			out_mem(esc, 6);
+			break;
+		}
+		p++;
+	}
+}
+
+/*s as a quoted json string*/
+void out_json_str(const char *s){
+	out_char('"');
+	out_json_chars(s, strlen(s));
+	out_char('"');
+}
+
+/*length of the valid utf-8 sequence at p, 0 if there is none.
+no overlongs, no surrogates, nothing past U+10FFFF*/
+static size_t utf8_len(const unsigned char *p, const unsigned char *end){
+	unsigned char lo;
+	unsigned char hi;
+	size_t len;
+	size_t i;
+
+	lo = 0x80;
+	hi = 0xbf;
+	if (*p >= 0xc2 && *p <= 0xdf) {
+		len = 2;
+	} else if (*p >= 0xe0 && *p <= 0xef) {
+		len = 3;
+		if (*p == 0xe0) {
+			lo = 0xa0;
+		} else if (*p == 0xed) {
+			hi = 0x9f;
+		}
+	} else if (*p >= 0xf0 && *p <= 0xf4) {
+		len = 4;
+		if (*p == 0xf0) {
+			lo = 0x90;
+		} else if (*p == 0xf4) {
+			hi = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+	if ((size_t)(end - p) < len || p[1] < lo || p[1] > hi) {
+		return 0;
+	}
+	for (i = 2; i < len; i++) {
+		if (p[i] < 0x80 || p[i] > 0xbf) {
+			return 0;
+		}
+	}
+	return len;
+}
@@ -4,10 +4,8 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
-#include <ctype.h>
-#include <grp.h>
-#include <pwd.h>
-#include <stdio.h>
+#include <err.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -17,174 +15,167 @@
 
 static int get_terminal_width(void);
 static void print_time(time_t t);
-void print_filename_sanitized(const char *name) {
-    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
-        if (isprint(*p)) {
-            putchar(*p);
-        }
-		else {
-            putchar('?');
-        }
-    }
+static const char *json_type(mode_t mode);
+/*name, with -q each byte that isnt printable ascii shown as '?'.
+ni is from name_scan, clean names go out in one copy*/
+void print_name(const char *name, const struct name_info *ni, const struct options *opts) {
+	const char *p;
+	const char *end;
+	const char *run;
+
+	if (!opts->printable_only || ni->clean) {
+		out_mem(name, ni->len);
+		return;
+	}
+	end = name + ni->len;
+	for (p = run = name; p < end; p++) {
+		if (*(const unsigned char *)p < 0x20 || *(const unsigned char *)p >= 0x7f) {
+			out_mem(run, (size_t)(p - run));
+			out_char('?');
+			run = p + 1;
+		}
+	}
+	out_mem(run, (size_t)(end - run));
 }
 /*print suffix for -F*/
-void print_suffix(const struct stat *sb) {
-    if (S_ISDIR(sb->st_mode)) {
-        putchar('/');
+void print_suffix(const struct entry_meta *m) {
+    if (S_ISDIR(m->mode)) {
+        out_char('/');
     }
-    else if (S_ISLNK(sb->st_mode)) {
-        putchar('@');
+    else if (S_ISLNK(m->mode)) {
+        out_char('@');
     }
 #ifdef S_ISWHT   
 /*handles whiteout files, if they exist on the system it will do this, else it wont*/
-    else if (S_ISWHT(sb->st_mode)) {
-        putchar('%');
+    else if (S_ISWHT(m->mode)) {
+        out_char('%');
     }
 #endif
-    else if (S_ISSOCK(sb->st_mode)) {
-        putchar('=');
+    else if (S_ISSOCK(m->mode)) {
+        out_char('=');
     }
-    else if (S_ISFIFO(sb->st_mode)) {
-        putchar('|');
+    else if (S_ISFIFO(m->mode)) {
+        out_char('|');
     }
-    else if (S_ISREG(sb->st_mode)&&((sb->st_mode&S_IXUSR)||(sb->st_mode&S_IXGRP)||(sb->st_mode&S_IXOTH))) {
-        putchar('*');
+    else if (S_ISREG(m->mode)&&((m->mode&S_IXUSR)||(m->mode&S_IXGRP)||(m->mode&S_IXOTH))) {
+        out_char('*');
     }
 }
 
 /*PRINTS prefix size for -s*/
-void print_size_column(const struct stat *sb, const struct options *opts) {
+void print_size_column(const struct entry_meta *m, const struct options *opts) {
     if (opts->human_readable) {
         //-h
         char buf[16];
-        uint64_t bytes = (uint64_t)sb->st_blocks * 512;
+        uint64_t bytes = (uint64_t)m->blocks * 512;
         format_size(bytes, buf, sizeof(buf));
-        printf("%6s ", buf);
+        out_pad(6 - (int)strlen(buf));
+        out_str(buf);
+        out_char(' ');
     } 
 	else if (opts->kilobytes) {
         //-k: kilobytes
-        unsigned long kb = (sb->st_blocks + 1) / 2; // round up
-        printf("%4lu ", kb);
+        unsigned long kb = (m->blocks + 1) / 2; // round up
+        out_uint(kb, 4);
+        out_char(' ');
     } 
 	else {
         // -s: block count
-        printf("%4lu ", (unsigned long)sb->st_blocks);
+        out_uint((uint64_t)m->blocks, 4);
+        out_char(' ');
     }
 }
 /*PRINTS sizes depending on flag*/
-void print_size_long(const struct stat *sb, const struct options *opts) {
+void print_size_long(const struct entry_meta *m, const struct options *opts) {
     if (opts->human_readable) {
         char buf[16];
-        format_size((uint64_t)sb->st_size, buf, sizeof(buf));
-        printf("%6s ", buf);
+        format_size((uint64_t)m->size, buf, sizeof(buf));
+        out_pad(6 - (int)strlen(buf));
+        out_str(buf);
+        out_char(' ');
     }
     else {
-        printf("%4lu ", (unsigned long)sb->st_blocks);
+        out_uint((uint64_t)m->blocks, 4);
+        out_char(' ');
     }
 }
 
 /*Print file long format -l -n*/
-void print_long_format(const char *name, const struct stat *sb, const struct options *opts){
-	char mode_str[12];
-	struct passwd *pw;
-	struct group *gr;
-	char *owner;
-	char *group;
+void print_long_format(const char *name, const struct entry_meta *m, const char *link, const struct options *opts){
+	struct name_info ni;
+
 	if(opts->inode){
-		printf("%9lu ", (unsigned long)sb->st_ino);
+		out_uint(m->ino, 9);
+		out_char(' ');
 	}
 	/*-s prefix print*/
 	if(opts->blocks){
-		print_size_column(sb, opts);
+		print_size_column(m, opts);
 	}
-	strmode(sb->st_mode, mode_str);
-	(void)printf("%s", mode_str);
+	out_mode(m->mode);
 	/*number of links*/
-	(void)printf(" %3lu", (unsigned long)sb->st_nlink);
+	out_char(' ');
+	out_uint(m->nlink, 3);
 
 	if((opts->long_format)&&!(opts->numeric_ids)){
-		/*owner name*/
-		if ((pw = getpwuid(sb->st_uid)) != NULL) {
-			owner = pw->pw_name;
-		} 
-		else {
-			static char uid_buf[32];
-			(void)snprintf(uid_buf, sizeof(uid_buf), "%u", sb->st_uid);
-			owner = uid_buf;
-		}
-		(void)printf(" %-8s", owner);
-
-		/*group name*/
-		if ((gr = getgrgid(sb->st_gid)) != NULL) {
-			group = gr->gr_name;
-		}
-		else {
-			static char gid_buf[32];
-			(void)snprintf(gid_buf, sizeof(gid_buf), "%u", sb->st_gid);
-			group = gid_buf;
-		}
-		(void)printf(" %-8s", group);
+		/*owner and group name, cached*/
+		out_char(' ');
+		out_str_left(user_name(m->uid), 8);
+		out_char(' ');
+		out_str_left(group_name(m->gid), 8);
 	}
 	/*n case numerical uid/gid*/
 	else{
 		/*owner num*/
-		(void)printf(" %u", sb->st_uid);
+		out_char(' ');
+		out_uint(m->uid, 0);
 		/*group num*/
-		(void)printf(" %u", sb->st_gid);
+		out_char(' ');
+		out_uint(m->gid, 0);
 	}
 	/*file size
 	accounts for flag h*/
 	if(opts->human_readable){
-		print_size_long(sb, opts);
+		print_size_long(m, opts);
 	}
 	else{
-		(void)printf(" %8lld", (long long)sb->st_size);
+		out_char(' ');
+		out_int(m->size, 8);
 	}
-	/*modification time*/
-	(void)printf(" ");
-	if(opts->use_atime){
-		print_time(sb->st_atime);
-	}
-	else if(opts->use_ctime){
-		print_time(sb->st_ctime);
-	}
-	else {print_time(sb->st_mtime);}
-	putchar(' ');
+	/*modification time, or -u/-c time*/
+	out_char(' ');
+	print_time(m->time);
+	out_char(' ');
 	/*filename -q check*/
-	if(opts->printable_only) {
-		print_filename_sanitized(name);
-	} 
-	else {
-		(void)printf(" %s", name);
+	if(!opts->printable_only) {
+		out_char(' ');
 	}
+	name_scan(name, &ni);
+	print_name(name, &ni, opts);
 
-	/*print symlink destination*/
-    if (S_ISLNK(sb->st_mode)) {
-        char linkbuf[PATH_MAX];
-        ssize_t len;
-        
-        len = readlink(name, linkbuf, sizeof(linkbuf) - 1);
-        if (len != -1) {
-            linkbuf[len] = '\0';
-            printf(" -> %s", linkbuf);
-        }
+	/*print symlink destination, read by the caller*/
+    if (S_ISLNK(m->mode) && link != NULL) {
+        out_str(" -> ");
+        out_str(link);
     }
 
 	/*prints in case of -F flag*/
 	if(opts->classify){
-		print_suffix(sb);
+		print_suffix(m);
 	}
-	(void)printf("\n");
+	out_eol();
 }
 
 /*print filename simple format. 
 used when file is explicitly specified maybe adds*/
 void print_simple(const char *name){
-	(void)printf("%s\n", name);
+	out_str(name);
+	out_eol();
 }
 
 /*print files in column*/
 void print_columns(struct file_entry *entries, int count, const struct options *opts){
+	struct name_info *names;
 	int term_width;
 	int max_len;
 	int col_width;
@@ -202,20 +193,26 @@ void print_columns(struct file_entry *entries, int count, const struct options *
 	/*terminal width*/
 	term_width = get_terminal_width();
 
-	/*longest filename loop*/
+	/*scan each name once, longest filename loop*/
+	if ((names = malloc((size_t)count * sizeof(struct name_info))) == NULL) {
+		err(1, NULL);
+	}
 	max_len = 0;
 	for (i = 0; i < count; i++) {
-		int len;
-		len = strlen(entries[i].name);
-		if (len > max_len) {
-			max_len = len;
+		name_scan(entries[i].name, &names[i]);
+		/*-q shows every byte as one char*/
+		if (opts->printable_only) {
+			names[i].width = names[i].len;
+		}
+		if ((int)names[i].width > max_len) {
+			max_len = (int)names[i].width;
 		}
 	}
 	col_width = max_len + 1;
 
 	/*number of columns/rows that fit*/
 	num_cols = term_width / col_width;
-	if (num_cols<1) {
+	if (num_cols<1 || opts->one_per_line) {
 		num_cols=1;
 	}
 	num_rows = (count+num_cols-1)/num_cols;
@@ -228,54 +225,168 @@ void print_columns(struct file_entry *entries, int count, const struct options *
 				break;
 			}
 			if(opts->inode){
-				printf("%9lu ", (unsigned long)entries[idx].sb.st_ino);
+				out_uint(entries[idx].m.ino, 9);
+				out_char(' ');
 			}
 			/*print leading sz -s*/
 			if(opts->blocks){
-				print_size_column(&entries[idx].sb, opts);
-			}
-			/*filename -q check*/
-			if (opts->printable_only) {
-				print_filename_sanitized(entries[idx].name);
-			} 
-			else {
-				(void)printf("%s", entries[idx].name);
+				print_size_column(&entries[idx].m, opts);
 			}
+			print_name(entries[idx].name, &names[idx], opts);
 			/*prints in case of -F flag*/
 			if(opts->classify){
-				print_suffix(&entries[idx].sb);
+				print_suffix(&entries[idx].m);
 			}
 			/*padding unless last col*/
 			if (col < num_cols - 1 && idx + num_rows < count) {
-				int padding;
-				int name_len;
-				name_len = strlen(entries[idx].name);
-				padding = col_width - name_len;
-				while (padding>0) {
-					(void)putchar(' ');
-					padding--;
-				}
+				out_pad(col_width - (int)names[idx].width);
 			}
 		}
-		(void)putchar('\n');
+		out_eol();
+	}
+	free(names);
+}
+
+/*one json object per line for --json: full path, raw stat fields and
+the link target. dir is NULL for operands, name is then the path*/
+void print_json(const char *dir, const char *name, const struct entry_meta *m,
+    const char *link, const struct options *opts){
+	size_t len;
+
+	out_str("{\"path\":\"");
+	if (dir != NULL && (len = strlen(dir)) > 0) {
+		out_json_chars(dir, len);
+		if (dir[len - 1] != '/') {
+			out_char('/');
+		}
+	}
+	out_json_chars(name, strlen(name));
+	out_str("\",\"name\":");
+	out_json_str(name);
+	out_str(",\"type\":\"");
+	out_str(json_type(m->mode));
+	out_str("\",\"mode\":");
+	out_uint(m->mode, 0);
+	out_str(",\"ino\":");
+	out_uint(m->ino, 0);
+	out_str(",\"nlink\":");
+	out_uint(m->nlink, 0);
+	out_str(",\"uid\":");
+	out_uint(m->uid, 0);
+	out_str(",\"gid\":");
+	out_uint(m->gid, 0);
+	/*names only when -l would show them*/
+	if ((opts->long_format)&&!(opts->numeric_ids)) {
+		out_str(",\"user\":");
+		out_json_str(user_name(m->uid));
+		out_str(",\"group\":");
+		out_json_str(group_name(m->gid));
+	}
+	out_str(",\"size\":");
+	out_int(m->size, 0);
+	out_str(",\"blocks\":");
+	out_int(m->blocks, 0);
+	out_str(opts->use_atime ? ",\"atime\":" : opts->use_ctime ? ",\"ctime\":" : ",\"mtime\":");
+	out_int(m->time, 0);
+	if (link != NULL) {
+		out_str(",\"target\":");
+		out_json_str(link);
+	}
+	/*out_char so a terminal gets each record as it is done*/
+	out_char('}');
+	out_char('\n');
+}
+
+/*--du line for a dir, after its subtree: entries below it and their
+total in the units of the total line. a json object with --json*/
+void print_du(const char *path, const struct du_total *du, const struct options *opts){
+	if (opts->json) {
+		out_str("{\"path\":");
+		out_json_str(path);
+		out_str(",\"du_entries\":");
+		out_uint(du->entries, 0);
+		out_str(",\"du_blocks\":");
+		out_uint(du->blocks, 0);
+		out_str(",\"du_size\":");
+		out_uint(du->bytes, 0);
+		out_char('}');
+		out_char('\n');
+		return;
+	}
+	out_str(path);
+	out_str(": ");
+	out_uint(du->entries, 0);
+	out_str(" entries, total ");
+	if (opts->human_readable) {
+		out_uint((du->bytes + 1023) / 1024, 0);
+		out_char('K');
+	} else if (opts->kilobytes) {
+		out_uint((du->blocks + 1) / 2, 0);
+	} else {
+		out_uint(du->blocks, 0);
+	}
+	out_eol();
+}
+
+/*the entries of one listing in the format the flags ask for.
+dir is the directory they are in, for --json paths*/
+void print_files(struct file_entry *files, int count, const char *dir, const struct options *opts){
+	int i;
+
+	/*all owner/group names up front, not one NSS call per line*/
+	if ((opts->long_format)&&!(opts->numeric_ids)) {
+		idcache_prime(files, count);
+	}
+	if (opts->json) {
+		for (i = 0; i < count; i++) {
+			print_json(dir, files[i].name, &files[i].m, files[i].link, opts);
+		}
+	} else if ((opts->long_format)||(opts->numeric_ids)) {
+		/*long -l or n, one file per line with details*/
+		for (i = 0; i < count; i++) {
+			print_long_format(files[i].name, &files[i].m, files[i].link, opts);
+		}
+	} else {
+		/*simple form with columns*/
+		print_columns(files, count, opts);
+	}
+}
+
+/*type name for --json*/
+static const char *json_type(mode_t mode){
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return "file";
+	case S_IFDIR:
+		return "dir";
+	case S_IFLNK:
+		return "symlink";
+	case S_IFIFO:
+		return "fifo";
+	case S_IFSOCK:
+		return "socket";
+	case S_IFCHR:
+		return "char";
+	case S_IFBLK:
+		return "block";
+	default:
+		return "unknown";
 	}
 }
 
 /*terminal width.*/
 static int get_terminal_width(void) {
 	struct winsize ws;
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+	if (ioctl(out_fd(), TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
 		return ws.ws_col;
 	}
 	return 80;/*standard default terminal width, no macro available*/
 }
 
-/*formatted time.*/
+/*formatted time, from the cache in timefmt.c*/
 static void print_time(time_t t) {
-	char buf[64];
-	struct tm *tm;
-	if ((tm = localtime(&t)) != NULL) {
-		(void)strftime(buf, sizeof(buf), "%b %d %H:%M", tm);
-		(void)printf("%s", buf);
+	const char *s;
+	if ((s = format_time(t)) != NULL) {
+		out_str(s);
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,183 @@
+/*scan.c - one pass over a name for its length, width and -q state*/
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * print_columns needs the width of every name twice and -q needs to know
+ * if a name has anything to replace. name_scan gets length, width and
+ * "printable ascii only" in one pass, 32 or 16 bytes at a time with
+ * AVX2 or SSE2, else a byte at a time.
+ *
+ * Width is the code point count, continuation bytes (10xxxxxx) take no
+ * column. Without a locale there is no wcwidth, so wide chars count one.
+ *
+ * The vector loops read whole aligned blocks: an aligned block never
+ * crosses a page, so reading past the nul (or before the start, to get
+ * aligned) cannot fault, the extra bytes are masked off. ASan cant
+ * know that, so it is told not to look.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCAN_NO_ASAN	__attribute__((no_sanitize_address))
+#endif
+#elif defined(__SANITIZE_ADDRESS__)
+#define SCAN_NO_ASAN	__attribute__((no_sanitize_address))
+#endif
+#ifndef SCAN_NO_ASAN
+#define SCAN_NO_ASAN
+#endif
+
+#ifdef SCAN_SIMD
+static void scan_sse2(const char *s, struct name_info *ni);
+static void scan_avx2(const char *s, struct name_info *ni);
+#else
+static void scan_scalar(const char *s, struct name_info *ni);
+#endif
+
+/*length, width and -q cleanliness of s*/
+void name_scan(const char *s, struct name_info *ni){
+#ifdef SCAN_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		scan_avx2(s, ni);
+		return;
+	}
+	scan_sse2(s, ni);
+#else
+	scan_scalar(s, ni);
+#endif
+}
+
+#ifndef SCAN_SIMD
+/*the same a byte at a time, for other cpus*/
+static void scan_scalar(const char *s, struct name_info *ni){
+	const unsigned char *p;
+	size_t cont;
+	bool clean;
+
+	clean = true;
+	cont = 0;
+	for (p = (const unsigned char *)s; *p != '\0'; p++) {
+		if (*p < 0x20 || *p >= 0x7f) {
+			clean = false;
+			if ((*p & 0xc0) == 0x80) {
+				cont++;
+			}
+		}
+	}
+	ni->len = (size_t)(p - (const unsigned char *)s);
+	ni->width = ni->len - cont;
+	ni->clean = clean;
+}
+#else
+/*
+ * Per block, as signed bytes: nul is == 0, printable ascii is
+ * 0x20..0x7e so > 0x1f and < 0x7f, and continuation bytes 0x80..0xbf
+ * are < (signed)0xc0. Bit i of each mask is byte i of the block.
+ */
+SCAN_NO_ASAN
+static void scan_sse2(const char *s, struct name_info *ni){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+	const __m128i cont_max = _mm_set1_epi8((char)0xc0);
+	const char *p;
+	__m128i v;
+	uint32_t skip;
+	uint32_t nul;
+	uint32_t bad;
+	uint32_t cont;
+	uint32_t keep;
+	size_t ncont;
+	bool clean;
+
+	/*first block starts before s, drop those bytes*/
+	p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+	skip = (uint32_t)(s - p);
+	clean = true;
+	ncont = 0;
+	for (;;) {
+		v = _mm_load_si128((const __m128i *)p);
+		nul = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		bad = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi))) ^ 0xffff;
+		cont = (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(v, cont_max));
+		keep = (0xffffu << skip) & 0xffff;
+		nul &= keep;
+		if (nul != 0) {
+			/*bytes before the nul only*/
+			keep &= (nul & -nul) - 1;
+		}
+		if ((bad & keep) != 0) {
+			clean = false;
+		}
+		ncont += (size_t)__builtin_popcount(cont & keep);
+		if (nul != 0) {
+			ni->len = (size_t)(p - s) + (size_t)__builtin_ctz(nul);
+			break;
+		}
+		skip = 0;
+		p += 16;
+	}
+	ni->width = ni->len - ncont;
+	ni->clean = clean;
+}
+
+__attribute__((target("avx2"))) SCAN_NO_ASAN
+static void scan_avx2(const char *s, struct name_info *ni){
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lo = _mm256_set1_epi8(0x1f);
+	const __m256i hi = _mm256_set1_epi8(0x7f);
+	const __m256i cont_max = _mm256_set1_epi8((char)0xc0);
+	const char *p;
+	__m256i v;
+	uint32_t skip;
+	uint32_t nul;
+	uint32_t bad;
+	uint32_t cont;
+	uint32_t keep;
+	size_t ncont;
+	bool clean;
+
+	p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+	skip = (uint32_t)(s - p);
+	clean = true;
+	ncont = 0;
+	for (;;) {
+		v = _mm256_load_si256((const __m256i *)p);
+		nul = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		/*no signed less-than in avx2, hi > v instead*/
+		bad = ~(uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v)));
+		cont = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont_max, v));
+		keep = 0xffffffffu << skip;
+		nul &= keep;
+		if (nul != 0) {
+			keep &= (nul & -nul) - 1;
+		}
+		if ((bad & keep) != 0) {
+			clean = false;
+		}
+		ncont += (size_t)__builtin_popcount(cont & keep);
+		if (nul != 0) {
+			ni->len = (size_t)(p - s) + (size_t)__builtin_ctz(nul);
+			break;
+		}
+		skip = 0;
+		p += 32;
+	}
+	ni->width = ni->len - ncont;
+	ni->clean = clean;
+}
+#endif
@@ -0,0 +1,586 @@
+/*serve.c - ls --serve, a daemon that lists for ls --client*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+/*
+ * Every ls pays for exec, the loader, NSS setup and cold uid/gid and
+ * time caches before it reads a dir. ls --serve SOCKET pays that once:
+ * it listens on a unix socket, and ls --client SOCKET sends it its argv
+ * along with fds for its cwd, stdout and stderr (SCM_RIGHTS), then
+ * exits with the status that comes back. The daemon writes the listing
+ * straight to the client's stdout and its warnings to the client's
+ * stderr, so a pipe or terminal gets what plain ls would have written.
+ *
+ * Requests are taken by -j worker threads, one per cpu by default. Each
+ * has a cwd of its own (unshare CLONE_FS) to fchdir to the client's,
+ * an outctx and a time cache that stays warm between requests. The
+ * uid/gid names are all loaded at startup and shared, and the --cache
+ * dir given to --serve is the one every request uses. --du requests
+ * take turns, the set of hard links seen is one per process.
+ *
+ * What the daemon cant do as the client would (--watch, --stats, or a
+ * client with another TZ) it sends back to the client to list itself,
+ * and so is everything when no daemon answers. Only the daemon's own
+ * user may connect.
+ */
+
+/*first word of a request, "lsd1"*/
+#define SERVE_MAGIC	0x6c736431u
+/*most bytes of argv a request may carry*/
+#define SERVE_MAX_ARGS	(16 * 1024 * 1024)
+/*fds that come with a request: cwd, stdout, stderr*/
+#define SERVE_NFDS	3
+/*reply status: list it yourself*/
+#define SERVE_LOCAL	(-1)
+
+/*sent with the fds, then len bytes: argc nul terminated strings and
+"=" and the client's TZ, or "" if it has none*/
+struct serve_request {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t len;
+};
+
+struct serve_reply {
+	int32_t status;		/* exit status, or SERVE_LOCAL */
+	int32_t sig;		/* raise this instead, SIGPIPE */
+};
+
+struct serve_worker {
+	pthread_t thread;
+	int lfd;
+	struct outctx *out;
+};
+
+/*getopt is one per process*/
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+/*and so is the --du link set*/
+static pthread_mutex_t du_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *serve_cache;	/* absolute, workers chdir per request */
+static struct stat serve_cache_st;
+
+static int serve_listen(const char *path);
+static bool serve_addr(const char *path, struct sockaddr_un *sa);
+static void *serve_worker(void *arg);
+static void serve_conn(struct serve_worker *w, int conn);
+static int serve_list(struct serve_worker *w, int conn, int argc, char *argv[], const int *fds);
+static bool serve_cache_same(const char *dir);
+static bool serve_peer(int conn);
+static bool serve_recv(int conn, struct serve_request *req, int *fds);
+static bool tz_same(const char *tz);
+static bool read_full(int fd, void *buf, size_t len);
+static bool send_full(int fd, const void *buf, size_t len);
+
+/*listen on path until SIGINT, SIGTERM or SIGHUP. only -j and --cache
+of opts matter, the rest come with each request*/
+int serve_run(const char *path, const struct options *opts){
+	struct serve_worker *workers;
+	sigset_t sigs;
+	long n;
+	int lfd;
+	int sig;
+	int i;
+
+	lfd = serve_listen(path);
+
+	/*warm what every request would otherwise set up*/
+	tzset();
+	idcache_share();
+	/*cache_init makes the dir, then it is kept by its absolute path*/
+	if (opts->cache_dir != NULL && cache_init(opts->cache_dir)) {
+		serve_cache = realpath(opts->cache_dir, NULL);
+		if (serve_cache == NULL || stat(serve_cache, &serve_cache_st) < 0 ||
+		    !cache_init(serve_cache)) {
+			free(serve_cache);
+			serve_cache = NULL;
+		}
+	}
+
+	/*the workers get the signals blocked, this thread waits for them.
+	a client gone from its pipe is an EPIPE for the one request*/
+	(void)sigemptyset(&sigs);
+	(void)sigaddset(&sigs, SIGINT);
+	(void)sigaddset(&sigs, SIGTERM);
+	(void)sigaddset(&sigs, SIGHUP);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &sigs, NULL)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	n = opts->jobs > 0 ? opts->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		n = 1;
+	} else if (n > MAX_JOBS) {
+		n = MAX_JOBS;
+	}
+#if !defined(__linux__) || !defined(CLONE_FS)
+	/*no cwd per thread, one request at a time*/
+	n = 1;
+#endif
+	if ((workers = calloc((size_t)n, sizeof(struct serve_worker))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < n; i++) {
+		workers[i].lfd = lfd;
+		workers[i].out = out_new();
+		if ((errno = pthread_create(&workers[i].thread, NULL, serve_worker,
+		    &workers[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+
+	while (sigwait(&sigs, &sig) != 0) {
+		continue;
+	}
+	(void)unlink(path);
+	return EXIT_SUCCESS;
+}
+
+/*ls --client: have the daemon at path list argv. false if it wont or
+cant (no daemon, --watch or --stats, another TZ) and ls lists itself,
+else status is what to exit with*/
+bool client_run(const char *path, int argc, char *argv[], const struct options *opts,
+    int *status){
+	struct sockaddr_un sa;
+	struct serve_request req;
+	struct serve_reply rep;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		char buf[CMSG_SPACE(SERVE_NFDS * sizeof(int))];
+		struct cmsghdr align;
+	} cb;
+	int fds[SERVE_NFDS];
+	const char *tz;
+	char *args;
+	size_t len;
+	size_t off;
+	ssize_t n;
+	int fd;
+	int i;
+
+	if (opts->watch || opts->stats || opts->stats_trace != NULL || !serve_addr(path, &sa)) {
+		return false;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		return false;
+	}
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		(void)close(fd);
+		return false;
+	}
+#ifdef O_PATH
+	fds[0] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+	fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+	if (fds[0] < 0) {
+		(void)close(fd);
+		return false;
+	}
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+
+	/*argv as it came, the daemon parses it again*/
+	tz = getenv("TZ");
+	len = tz != NULL ? strlen(tz) + 2 : 1;
+	for (i = 0; i < argc; i++) {
+		len += strlen(argv[i]) + 1;
+	}
+	if (len > SERVE_MAX_ARGS || (args = malloc(len)) == NULL) {
+		(void)close(fds[0]);
+		(void)close(fd);
+		return false;
+	}
+	off = 0;
+	for (i = 0; i < argc; i++) {
+		(void)memcpy(args + off, argv[i], strlen(argv[i]) + 1);
+		off += strlen(argv[i]) + 1;
+	}
+	args[off] = '\0';
+	if (tz != NULL) {
+		args[off] = '=';
+		(void)memcpy(args + off + 1, tz, strlen(tz) + 1);
+	}
+
+	req.magic = SERVE_MAGIC;
+	req.argc = (uint32_t)argc;
+	req.len = (uint32_t)len;
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	(void)memset(&mh, 0, sizeof(mh));
+	(void)memset(&cb, 0, sizeof(cb));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.buf;
+	mh.msg_controllen = sizeof(cb.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(SERVE_NFDS * sizeof(int));
+	(void)memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	do {
+		n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	(void)close(fds[0]);
+	if (n != (ssize_t)sizeof(req) || !send_full(fd, args, len)) {
+		free(args);
+		(void)close(fd);
+		return false;
+	}
+	free(args);
+
+	/*the listing is on stdout by now, or under way*/
+	if (!read_full(fd, &rep, sizeof(rep))) {
+		warnx("%s: daemon went away", path);
+		(void)close(fd);
+		*status = EXIT_FAILURE;
+		return true;
+	}
+	(void)close(fd);
+	if (rep.status == SERVE_LOCAL) {
+		return false;
+	}
+	if (rep.sig != 0) {
+		(void)signal(rep.sig, SIG_DFL);
+		(void)raise(rep.sig);
+	}
+	*status = rep.status;
+	return true;
+}
+
+/*a listening socket at path, a stale one from a dead daemon replaced*/
+static int serve_listen(const char *path){
+	struct sockaddr_un sa;
+	mode_t mask;
+	int fd;
+	int r;
+
+	if (!serve_addr(path, &sa)) {
+		errx(1, "%s: socket path too long", path);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		err(1, "socket");
+	}
+	/*owner only, the peer check below is linux only*/
+	mask = umask(077);
+	if ((r = bind(fd, (struct sockaddr *)&sa, sizeof(sa))) < 0 && errno == EADDRINUSE) {
+		int probe;
+
+		if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+			err(1, "socket");
+		}
+		if (connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+			errx(1, "%s: a daemon is listening there", path);
+		}
+		(void)close(probe);
+		(void)unlink(path);
+		r = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	}
+	(void)umask(mask);
+	if (r < 0 || listen(fd, SOMAXCONN) < 0) {
+		err(1, "%s", path);
+	}
+	return fd;
+}
+
+static bool serve_addr(const char *path, struct sockaddr_un *sa){
+	(void)memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		return false;
+	}
+	(void)memcpy(sa->sun_path, path, strlen(path) + 1);
+	return true;
+}
+
+/*take requests one at a time, forever*/
+static void *serve_worker(void *arg){
+	struct serve_worker *w = arg;
+	int conn;
+
+#if defined(__linux__) && defined(CLONE_FS)
+	/*a cwd of its own, and of the -j threads it starts*/
+	if (unshare(CLONE_FS) < 0) {
+		err(1, "unshare");
+	}
+#endif
+	for (;;) {
+		if ((conn = accept(w->lfd, NULL, NULL)) < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				struct timespec ts = { 0, 10 * 1000 * 1000 };
+
+				/*out of fds most likely, let some close*/
+				warn("accept");
+				(void)nanosleep(&ts, NULL);
+			}
+			continue;
+		}
+		serve_conn(w, conn);
+		(void)close(conn);
+	}
+	return NULL;
+}
+
+/*read one request off conn, list it and reply*/
+static void serve_conn(struct serve_worker *w, int conn){
+	struct serve_request req;
+	struct serve_reply rep;
+	char **argv;
+	char *args;
+	char *p;
+	char *end;
+	int fds[SERVE_NFDS];
+	uint32_t i;
+
+	for (i = 0; i < SERVE_NFDS; i++) {
+		fds[i] = -1;
+	}
+	args = NULL;
+	argv = NULL;
+	if (!serve_peer(conn) || !serve_recv(conn, &req, fds) || req.magic != SERVE_MAGIC ||
+	    req.argc < 1 || req.len > SERVE_MAX_ARGS || req.argc > req.len) {
+		goto done;
+	}
+	if ((args = malloc(req.len)) == NULL || (argv = malloc((req.argc + 1) * sizeof(char *))) == NULL) {
+		goto done;
+	}
+	if (!read_full(conn, args, req.len) || args[req.len - 1] != '\0') {
+		goto done;
+	}
+	/*argc strings, then the TZ*/
+	p = args;
+	end = args + req.len;
+	for (i = 0; i < req.argc && p < end; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	if (i < req.argc || p >= end) {
+		goto done;
+	}
+	argv[req.argc] = NULL;
+
+	rep.sig = 0;
+	if (!tz_same(p) || fchdir(fds[0]) < 0) {
+		rep.status = SERVE_LOCAL;
+	} else {
+		rep.status = serve_list(w, conn, (int)req.argc, argv, fds);
+		if (rep.status == -EPIPE) {
+			rep.status = EXIT_FAILURE;
+			rep.sig = SIGPIPE;
+		}
+	}
+	(void)send_full(conn, &rep, sizeof(rep));
+
+done:
+	for (i = 0; i < SERVE_NFDS; i++) {
+		if (fds[i] >= 0) {
+			(void)close(fds[i]);
+		}
+	}
+	free(argv);
+	free(args);
+}
+
+/*run one request as main would after its own parse. the exit status,
+SERVE_LOCAL, or -EPIPE if the client stopped reading*/
+static int serve_list(struct serve_worker *w, int conn, int argc, char *argv[], const int *fds){
+	struct options opts;
+	char msg[PARSE_MSG_LEN];
+	int first;
+	int error;
+	int ret;
+
+	out_open(w->out, fds[1], fds[2], conn);
+	/*any peer can send anything, a bad argv goes back to its stderr*/
+	pthread_mutex_lock(&parse_lock);
+	opterr = 0;
+	ret = parse_options_msg(argc, argv, &opts, msg, sizeof(msg));
+	first = optind;
+	pthread_mutex_unlock(&parse_lock);
+	if (ret != PARSE_OK) {
+		(void)out_close();
+		filter_free(opts.filter);
+		if (ret == PARSE_ERROR) {
+			(void)dprintf(fds[2], "ls: %s\n", msg);
+		} else {
+			(void)dprintf(fds[2], "%s", msg);
+		}
+		return EXIT_FAILURE;
+	}
+	if (opts.watch || opts.stats || opts.stats_trace != NULL || opts.serve != NULL) {
+		(void)out_close();
+		filter_free(opts.filter);
+		return SERVE_LOCAL;
+	}
+	/*only a --cache the daemon has open, and only when asked for*/
+	if (opts.cache_dir != NULL) {
+		if (!serve_cache_same(opts.cache_dir)) {
+			(void)out_close();
+			filter_free(opts.filter);
+			return SERVE_LOCAL;
+		}
+		opts.cache_dir = serve_cache;
+	}
+	if (opts.zero) {
+		out_set_eol('\0');
+	}
+	format_time_now();
+
+	if (opts.du) {
+		pthread_mutex_lock(&du_lock);
+	}
+	list_operands(&argv[first], argc - first, &opts);
+	if (opts.du) {
+		du_reset();
+		pthread_mutex_unlock(&du_lock);
+	}
+	error = out_close();
+	filter_free(opts.filter);
+	if (error == EPIPE) {
+		return -EPIPE;
+	}
+	return error != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*true if dir, from the client's cwd, is the daemon's --cache dir*/
+static bool serve_cache_same(const char *dir){
+	struct stat st;
+
+	if (serve_cache == NULL || stat(dir, &st) < 0) {
+		return false;
+	}
+	return st.st_dev == serve_cache_st.st_dev && st.st_ino == serve_cache_st.st_ino;
+}
+
+/*true if conn is from this daemon's own user*/
+static bool serve_peer(int conn){
+#ifdef SO_PEERCRED
+	struct ucred uc;
+	socklen_t len;
+
+	len = sizeof(uc);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0) {
+		return false;
+	}
+	return uc.uid == geteuid();
+#else
+	/*the socket is 0600*/
+	(void)conn;
+	return true;
+#endif
+}
+
+/*the request header and the fds that came with it*/
+static bool serve_recv(int conn, struct serve_request *req, int *fds){
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		char buf[CMSG_SPACE(SERVE_NFDS * sizeof(int))];
+		struct cmsghdr align;
+	} cb;
+	int got[SERVE_NFDS];
+	ssize_t n;
+	size_t nfds;
+	size_t i;
+
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	(void)memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.buf;
+	mh.msg_controllen = sizeof(cb.buf);
+	do {
+		n = recvmsg(conn, &mh, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return false;
+	}
+	nfds = 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds > SERVE_NFDS) {
+			nfds = SERVE_NFDS;
+		}
+		(void)memcpy(got, CMSG_DATA(cm), nfds * sizeof(int));
+	}
+	/*whatever came is closed by the caller, even if it is not enough*/
+	for (i = 0; i < nfds; i++) {
+		fds[i] = got[i];
+	}
+	return n == (ssize_t)sizeof(*req) && nfds == SERVE_NFDS &&
+	    (mh.msg_flags & MSG_CTRUNC) == 0;
+}
+
+/*the client's TZ as sent, against ours*/
+static bool tz_same(const char *tz){
+	const char *ours;
+
+	ours = getenv("TZ");
+	if (tz[0] != '=') {
+		return ours == NULL;
+	}
+	return ours != NULL && strcmp(tz + 1, ours) == 0;
+}
+
+static bool read_full(int fd, void *buf, size_t len){
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (n == 0) {
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static bool send_full(int fd, const void *buf, size_t len){
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
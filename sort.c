@@ -0,0 +1,204 @@
+/*sort.c - radix sort on precomputed keys for big listings*/
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * Each entry gets a (64-bit key, name, index) record and the records are
+ * sorted, not the entries. Keys are built so plain unsigned ascending
+ * order is the wanted order, -r included: descending orders and -r just
+ * flip the key bits, so there is no reverse pass.
+ *
+ * Name order keys on the first 8 bytes of the name, big endian, which
+ * orders like strcmp; only records with equal keys get a strcmp, on the
+ * rest of the name. -t and -S first sort by name that way, then do a
+ * stable radix pass on the time or size key, so equal times and sizes
+ * stay in name order exactly like compare_time/compare_size.
+ */
+
+struct sort_key {
+	uint64_t key;
+	const char *name;
+	uint32_t idx;
+};
+
+/*runs shorter than this are finished by insertion sort*/
+#define SORT_TIE_MIN	32
+
+static void radix_sort(struct sort_key *keys, struct sort_key *tmp, size_t n);
+static void sort_name_ties(struct sort_key *keys, struct sort_key *tmp, size_t n,
+    size_t depth, bool reverse);
+static uint64_t name_prefix(const char *name);
+static void insertion_sort(struct sort_key *keys, size_t n, size_t depth, bool reverse);
+
+/*sort_entries for big listings, same order as the qsort path.
+false, entries untouched, if there is no memory for the keys*/
+bool sort_entries_keyed(struct file_entry *entries, int count, const struct options *opts){
+	struct sort_key *keys;
+	struct sort_key *tmp;
+	struct file_entry *out;
+	uint64_t flip;
+	uint64_t v;
+	size_t n;
+	size_t i;
+
+	n = (size_t)count;
+	keys = lib_malloc(n * sizeof(struct sort_key));
+	tmp = lib_malloc(n * sizeof(struct sort_key));
+	out = lib_malloc(n * sizeof(struct file_entry));
+	if (keys == NULL || tmp == NULL || out == NULL) {
+		lib_free(keys);
+		lib_free(tmp);
+		lib_free(out);
+		return false;
+	}
+
+	/*name order first, for -t/-S thats the tie break*/
+	flip = opts->reverse ? UINT64_MAX : 0;
+	for (i = 0; i < n; i++) {
+		keys[i].key = name_prefix(entries[i].name) ^ flip;
+		keys[i].name = entries[i].name;
+		keys[i].idx = (uint32_t)i;
+	}
+	radix_sort(keys, tmp, n);
+	sort_name_ties(keys, tmp, n, 0, opts->reverse);
+
+	/*newest/largest first: signed value made unsigned, flipped
+	unless -r asks for oldest/smallest first*/
+	if (opts->sort_time || opts->sort_size) {
+		flip = opts->reverse ? 0 : UINT64_MAX;
+		for (i = 0; i < n; i++) {
+			const struct entry_meta *m = &entries[keys[i].idx].m;
+
+			v = (uint64_t)(opts->sort_time ? m->time : m->size);
+			keys[i].key = (v ^ ((uint64_t)1 << 63)) ^ flip;
+		}
+		radix_sort(keys, tmp, n);
+	}
+
+	/*apply the permutation*/
+	for (i = 0; i < n; i++) {
+		out[i] = entries[keys[i].idx];
+	}
+	(void)memcpy(entries, out, n * sizeof(struct file_entry));
+	lib_free(out);
+	lib_free(tmp);
+	lib_free(keys);
+	return true;
+}
+
+/*stable LSD radix sort, a byte per pass. passes where every key has
+the same byte are skipped, so narrow key ranges cost few passes*/
+static void radix_sort(struct sort_key *keys, struct sort_key *tmp, size_t n){
+	size_t counts[8][256];
+	struct sort_key *src;
+	struct sort_key *dst;
+	struct sort_key *swap;
+	size_t offset;
+	size_t c;
+	size_t i;
+	int pass;
+	int b;
+
+	(void)memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		for (pass = 0; pass < 8; pass++) {
+			counts[pass][(keys[i].key >> (pass * 8)) & 0xff]++;
+		}
+	}
+
+	src = keys;
+	dst = tmp;
+	for (pass = 0; pass < 8; pass++) {
+		/*all in one bucket, nothing to do*/
+		if (counts[pass][(keys[0].key >> (pass * 8)) & 0xff] == n) {
+			continue;
+		}
+		offset = 0;
+		for (b = 0; b < 256; b++) {
+			c = counts[pass][b];
+			counts[pass][b] = offset;
+			offset += c;
+		}
+		for (i = 0; i < n; i++) {
+			dst[counts[pass][(src[i].key >> (pass * 8)) & 0xff]++] = src[i];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != keys) {
+		(void)memcpy(keys, src, n * sizeof(struct sort_key));
+	}
+}
+
+/*runs with the same key so far are ordered by the next 8 bytes of
+the name, radix sorted again, until the names differ or end. short
+runs just get a strcmp sort on the rest of the name*/
+static void sort_name_ties(struct sort_key *keys, struct sort_key *tmp, size_t n,
+    size_t depth, bool reverse){
+	uint64_t flip;
+	size_t start;
+	size_t end;
+	size_t i;
+
+	flip = reverse ? UINT64_MAX : 0;
+	for (start = 0; start < n; start = end) {
+		for (end = start + 1; end < n && keys[end].key == keys[start].key; end++) {
+			continue;
+		}
+		if (end - start < 2) {
+			continue;
+		}
+		/*a nul in these 8 bytes means the names are equal, done*/
+		if (((keys[start].key ^ flip) & 0xff) == 0) {
+			continue;
+		}
+		if (end - start < SORT_TIE_MIN) {
+			insertion_sort(keys + start, end - start, depth + 8, reverse);
+			continue;
+		}
+		for (i = start; i < end; i++) {
+			keys[i].key = name_prefix(keys[i].name + depth + 8) ^ flip;
+		}
+		radix_sort(keys + start, tmp, end - start);
+		sort_name_ties(keys + start, tmp, end - start, depth + 8, reverse);
+	}
+}
+
+/*first 8 bytes, big endian, zero padded*/
+static uint64_t name_prefix(const char *name){
+	uint64_t key = 0;
+	int i;
+
+	for (i = 0; i < 8 && name[i] != '\0'; i++) {
+		key |= (uint64_t)(unsigned char)name[i] << (56 - i * 8);
+	}
+	return key;
+}
+
+/*short runs, names equal and nul free for their first depth bytes*/
+static void insertion_sort(struct sort_key *keys, size_t n, size_t depth, bool reverse){
+	struct sort_key k;
+	size_t i;
+	size_t j;
+	int c;
+
+	for (i = 1; i < n; i++) {
+		k = keys[i];
+		for (j = i; j > 0; j--) {
+			c = strcmp(keys[j - 1].name + depth, k.name + depth);
+			if (reverse ? c >= 0 : c <= 0) {
+				break;
+			}
+			keys[j] = keys[j - 1];
+		}
+		keys[j] = k;
+	}
+}
@@ -0,0 +1,253 @@
+/*stats.c - --stats counters, phase timings and the optional trace*/
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ls.h"
+
+/*
+ * Everything is a relaxed atomic add on a global, and a phase costs two
+ * clock_gettime calls (vDSO, no syscall) per directory, so --stats can
+ * stay on for real runs. Phase times from -j workers are summed over
+ * threads. Output is only ever written by one thread, so the format
+ * phase simply leaves out the write time that falls inside it.
+ *
+ * With --stats-trace every timed phase is also kept as an event and
+ * written at exit in Chrome trace format (chrome://tracing, Perfetto).
+ */
+
+bool stats_enabled;
+
+static const char *const counter_names[STATS_NCOUNTERS] = {
+	"dirs_opened", "entries_read", "stat_calls", "readlink_calls",
+	"passwd_lookups", "group_lookups", "cache_hits",
+};
+static const char *const phase_names[STATS_NPHASES] = {
+	"read", "stat", "sort", "format", "write",
+};
+
+static uint64_t counters[STATS_NCOUNTERS];
+static uint64_t phase_ns[STATS_NPHASES];
+static uint64_t peak_entries;
+static uint64_t start_ns;
+/*write time so far when the current format phase began*/
+static uint64_t format_write_mark;
+
+/*trace events, only with --stats-trace*/
+struct trace_event {
+	int phase;
+	char *dir;
+	uint64_t start;
+	uint64_t dur;
+	unsigned long tid;
+};
+
+static const char *trace_path;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_event *events;
+static size_t nevents;
+static size_t events_cap;
+static pthread_key_t tid_key;
+static unsigned long next_tid;
+
+static uint64_t now_ns(void);
+static unsigned long trace_tid(void);
+static void trace_add(int phase, const char *dir, uint64_t start, uint64_t dur);
+static void trace_write(void);
+static void json_string(FILE *fp, const char *s);
+
+/*turn stats on, trace to path if not NULL*/
+void stats_init(const char *path){
+	stats_enabled = true;
+	start_ns = now_ns();
+	if (path != NULL) {
+		trace_path = path;
+		if (pthread_key_create(&tid_key, NULL) != 0) {
+			err(1, "pthread_key_create");
+		}
+	}
+}
+
+/*start of a timed phase, 0 when stats are off*/
+uint64_t stats_now(void){
+	if (!stats_enabled) {
+		return 0;
+	}
+	return now_ns();
+}
+
+/*stats_now for a format phase, which must not count the writes in it*/
+uint64_t stats_format_start(void){
+	if (!stats_enabled) {
+		return 0;
+	}
+	format_write_mark = __atomic_load_n(&phase_ns[STATS_WRITE], __ATOMIC_RELAXED);
+	return now_ns();
+}
+
+/*end a phase begun at start, for directory dir (may be NULL)*/
+void stats_time(int phase, uint64_t start, const char *dir){
+	uint64_t end;
+	uint64_t dur;
+
+	if (!stats_enabled) {
+		return;
+	}
+	end = now_ns();
+	dur = end - start;
+	if (phase == STATS_FORMAT) {
+		dur -= __atomic_load_n(&phase_ns[STATS_WRITE], __ATOMIC_RELAXED) - format_write_mark;
+	}
+	__atomic_fetch_add(&phase_ns[phase], dur, __ATOMIC_RELAXED);
+	if (trace_path != NULL) {
+		trace_add(phase, dir, start, end - start);
+	}
+}
+
+void stats_add(int counter, uint64_t n){
+	if (!stats_enabled) {
+		return;
+	}
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*entries held at once by one listing, keeps the largest*/
+void stats_peak(uint64_t n){
+	uint64_t old;
+
+	if (!stats_enabled) {
+		return;
+	}
+	old = __atomic_load_n(&peak_entries, __ATOMIC_RELAXED);
+	while (n > old && !__atomic_compare_exchange_n(&peak_entries, &old, n,
+	    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		continue;
+	}
+}
+
+/*summary on stderr, one "name value" per line, and the trace file*/
+void stats_report(void){
+	int i;
+
+	if (!stats_enabled) {
+		return;
+	}
+	for (i = 0; i < STATS_NCOUNTERS; i++) {
+		(void)fprintf(stderr, "%-16s %llu\n", counter_names[i],
+		    (unsigned long long)counters[i]);
+	}
+	(void)fprintf(stderr, "%-16s %llu\n", "peak_entries",
+	    (unsigned long long)peak_entries);
+	for (i = 0; i < STATS_NPHASES; i++) {
+		(void)fprintf(stderr, "%s_ns%*s %llu\n", phase_names[i],
+		    (int)(13 - strlen(phase_names[i])), "", (unsigned long long)phase_ns[i]);
+	}
+	(void)fprintf(stderr, "%-16s %llu\n", "total_ns",
+	    (unsigned long long)(now_ns() - start_ns));
+	if (trace_path != NULL) {
+		trace_write();
+	}
+}
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*small per thread number for the trace, 1 is whoever asks first*/
+static unsigned long trace_tid(void){
+	void *p;
+
+	if ((p = pthread_getspecific(tid_key)) == NULL) {
+		p = (void *)(uintptr_t)__atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+		(void)pthread_setspecific(tid_key, p);
+	}
+	return (unsigned long)(uintptr_t)p;
+}
+
+static void trace_add(int phase, const char *dir, uint64_t start, uint64_t dur){
+	struct trace_event *ev;
+	char *copy;
+
+	copy = NULL;
+	if (dir != NULL && (copy = strdup(dir)) == NULL) {
+		err(1, NULL);
+	}
+	pthread_mutex_lock(&trace_lock);
+	if (nevents == events_cap) {
+		struct trace_event *new_events;
+
+		events_cap = events_cap == 0 ? 1024 : events_cap * 2;
+		new_events = realloc(events, events_cap * sizeof(struct trace_event));
+		if (new_events == NULL) {
+			err(1, NULL);
+		}
+		events = new_events;
+	}
+	ev = &events[nevents++];
+	ev->phase = phase;
+	ev->dir = copy;
+	ev->start = start;
+	ev->dur = dur;
+	ev->tid = trace_tid();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*complete events ("ph":"X"), times in microseconds from the start*/
+static void trace_write(void){
+	FILE *fp;
+	size_t i;
+
+	if ((fp = fopen(trace_path, "w")) == NULL) {
+		warn("%s", trace_path);
+		return;
+	}
+	(void)fputs("{\"traceEvents\":[\n", fp);
+	for (i = 0; i < nevents; i++) {
+		(void)fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+		    "\"ts\":%.3f,\"dur\":%.3f", phase_names[events[i].phase], events[i].tid,
+		    (double)(events[i].start - start_ns) / 1000, (double)events[i].dur / 1000);
+		if (events[i].dir != NULL) {
+			(void)fputs(",\"args\":{\"dir\":", fp);
+			json_string(fp, events[i].dir);
+			(void)fputc('}', fp);
+		}
+		(void)fputs(i + 1 < nevents ? "},\n" : "}\n", fp);
+		free(events[i].dir);
+	}
+	(void)fputs("]}\n", fp);
+	if (fclose(fp) != 0) {
+		warn("%s", trace_path);
+	}
+	free(events);
+	events = NULL;
+	nevents = 0;
+}
+
+/*s as a json string, bytes past ascii passed through*/
+static void json_string(FILE *fp, const char *s){
+	const unsigned char *p;
+
+	(void)fputc('"', fp);
+	for (p = (const unsigned char *)s; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			(void)fputc('\\', fp);
+			(void)fputc(*p, fp);
+		} else if (*p < 0x20 || *p == 0x7f) {
+			(void)fprintf(fp, "\\u%04x", *p);
+		} else {
+			(void)fputc(*p, fp);
+		}
+	}
+	(void)fputc('"', fp);
+}
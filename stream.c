@@ -0,0 +1,224 @@
+/*stream.c - constant memory listing for -f*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+/*
+ * With -f nothing is sorted, so output of one entry per line (-l, -n,
+ * -1, --json) can go out as readdir returns it instead of after the whole
+ * directory is read. Entries are taken STREAM_BATCH at a time: read,
+ * stat the batch (one io_uring batch with --uring), print, then the
+ * array and the name arena are reused, so memory does not grow with the
+ * directory. The total line needs every entry, so it comes last.
+ */
+
+static void stream_batch(int fd, const char *path, struct file_entry *files, int count,
+    const int *pending, int npending, struct arena *names, const struct meta_plan *mp,
+    const struct options *opts, struct dir_listing *dl);
+
+/*true if the listing can be printed as it is read*/
+bool stream_enabled(const struct options *opts){
+	if (!opts->unsorted || opts->dir_as_file) {
+		return false;
+	}
+	/*--head/--tail already hold only N*/
+	if (opts->head > 0 || opts->tail > 0) {
+		return false;
+	}
+	/*--cache keeps whole listings, --du walks with walk.c*/
+	if (opts->cache_dir != NULL || opts->du) {
+		return false;
+	}
+	/*columns need the longest name first*/
+	return (opts->long_format)||(opts->numeric_ids)||(opts->one_per_line)||(opts->json);
+}
+
+/*print dir name, relative to atfd, as it is read. for -R the subdirs
+are left in dl->subdirs in read order, with the dir fd if keep_fd;
+nothing else is kept. returns false with dl->error set if the dir cant be opened*/
+bool stream_directory_at(int atfd, const char *name, const char *path,
+    const struct options *opts, bool keep_fd, struct dir_listing *dl){
+	struct dents d;
+	struct dirent *entry;
+	struct file_entry *files;
+	struct arena names;
+	struct meta_plan plan;
+	int pending[STREAM_BATCH];
+	int npending;
+	int count;
+	int fd;
+	uint64_t t;
+	uint64_t nread;
+
+	dl->files = NULL;
+	dl->count = 0;
+	dl->total_blocks = 0;
+	dl->total_size_bytes = 0;
+	dl->error = 0;
+	dl->fd = -1;
+	arena_init(&dl->names);
+	dl->subdirs = NULL;
+	dl->nsubdirs = 0;
+	dl->path = path;
+	dl->map = NULL;
+	dl->map_len = 0;
+	(void)memset(&dl->du, 0, sizeof(dl->du));
+	dl->du_links = NULL;
+	dl->ndu_links = 0;
+
+	if ((fd = openat(atfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		dl->error = errno;
+		return false;
+	}
+	if (keep_fd && (dl->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		dl->error = errno;
+		(void)close(fd);
+		return false;
+	}
+	/*one buffer refilled, names are copied per batch*/
+	if (!dents_open(&d, fd, NULL, opts)) {
+		dl->error = d.error;
+		if (dl->fd >= 0) {
+			(void)close(dl->fd);
+			dl->fd = -1;
+		}
+		(void)close(fd);
+		return false;
+	}
+
+	stats_add(STATS_DIRS, 1);
+
+	meta_plan(opts, &plan);
+	if ((files = malloc(STREAM_BATCH * sizeof(struct file_entry))) == NULL) {
+		err(1, NULL);
+	}
+	arena_init(&names);
+
+	count = 0;
+	npending = 0;
+	t = stats_now();
+	while ((entry = dents_next(&d)) != NULL) {
+		if ((files[count].name = arena_strdup(&names, entry->d_name)) == NULL) {
+			err(1, NULL);
+		}
+		files[count].link = NULL;
+		if (plan.need != 0 && !meta_from_dirent(&plan, entry, &files[count].m)) {
+			pending[npending++] = count;
+		}
+		if (++count == STREAM_BATCH) {
+			stats_time(STATS_READ, t, path);
+			stream_batch(fd, path, files, count, pending, npending, &names,
+			    &plan, opts, dl);
+			arena_reset(&names);
+			count = 0;
+			npending = 0;
+			t = stats_now();
+		}
+	}
+	stats_time(STATS_READ, t, path);
+	nread = d.nread;
+	dents_close(&d);
+	stats_add(STATS_ENTRIES, nread);
+	if (count > 0) {
+		stream_batch(fd, path, files, count, pending, npending, &names,
+		    &plan, opts, dl);
+	}
+	t = stats_format_start();
+	print_total(dl->total_blocks, dl->total_size_bytes, opts);
+	stats_time(STATS_FORMAT, t, path);
+
+	arena_free(&names);
+	free(files);
+	(void)close(fd);
+	return true;
+}
+
+/*stat the pending entries of a batch, print it in read order and
+keep its subdirs. same stat error handling as read_directory_at*/
+static void stream_batch(int fd, const char *path, struct file_entry *files, int count,
+    const int *pending, int npending, struct arena *names, const struct meta_plan *mp,
+    const struct options *opts, struct dir_listing *dl){
+	int errs[STREAM_BATCH];
+	int kept;
+	int i;
+	int j;
+	uint64_t t;
+
+	t = stats_now();
+	stats_add(STATS_STATS, npending);
+	if (npending > 0) {
+		meta_stat_batch(fd, files, pending, npending, mp, errs);
+	}
+
+	kept = 0;
+	j = 0;
+	for (i = 0; i < count; i++) {
+		if (j < npending && pending[j] == i) {
+			if (errs[j++] != 0) {
+				errno = errs[j - 1];
+				out_warn("cannot stat '%s%s%s'", path,
+				    path[strlen(path) - 1] == '/' ? "" : "/", files[i].name);
+				continue;
+			}
+			if (wants_link(opts) && S_ISLNK(files[i].m.mode)) {
+				stats_add(STATS_READLINKS, 1);
+				files[i].link = read_link_at(fd, files[i].name, names);
+			}
+			dl->total_size_bytes += files[i].m.size;
+			dl->total_blocks += files[i].m.blocks;
+		}
+		files[kept++] = files[i];
+	}
+	count = kept;
+	stats_time(STATS_STAT, t, path);
+	stats_peak(count);
+
+	t = stats_format_start();
+	print_files(files, count, path, opts);
+	stats_time(STATS_FORMAT, t, path);
+
+	if (opts->recursive) {
+		for (i = 0; i < count; i++) {
+			if (is_recurse_dir(&files[i], opts)) {
+				keep_subdir(dl, &files[i]);
+			}
+		}
+	}
+}
+
+/*append a subdir to dl->subdirs, name copied into the listing arena.
+for readers that dont keep every entry in dl->files*/
+void keep_subdir(struct dir_listing *dl, const struct file_entry *fe){
+	struct file_entry *new_subdirs;
+	int n;
+	int capacity;
+
+	/*the array is 16, 32, 64... entries, so full at those counts*/
+	n = dl->nsubdirs;
+	if (n == 0 || (n >= 16 && (n & (n - 1)) == 0)) {
+		capacity = n == 0 ? 16 : n * 2;
+		new_subdirs = lib_realloc(dl->subdirs, capacity * sizeof(struct file_entry));
+		if (new_subdirs == NULL) {
+			err(1, NULL);
+		}
+		dl->subdirs = new_subdirs;
+	}
+	dl->subdirs[n] = *fe;
+	if ((dl->subdirs[n].name = arena_strdup(&dl->names, fe->name)) == NULL) {
+		err(1, NULL);
+	}
+	dl->subdirs[n].link = NULL;
+	dl->nsubdirs++;
+}
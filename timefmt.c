@@ -0,0 +1,217 @@
+/*timefmt.c - cached time column for long format*/
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "ls.h"
+
+/*
+ * Most files in a directory share a handful of minutes, so the rendered
+ * column is kept per minute in a small direct mapped table. On a miss
+ * the local time is worked out by hand from the UTC offset of that day,
+ * which is cached too: localtime is only called twice per day seen, to
+ * check the offset is the same at both ends (no DST change that day).
+ * Days with a change go through localtime every time.
+ *
+ * The tables are per thread, so --serve workers each keep theirs warm
+ * between requests without a lock.
+ */
+
+/*older than this, or in the future, shows the year not the time*/
+#define SIX_MONTHS	(31556952 / 2)
+
+#define MINUTE_SLOTS	256
+#define DAY_SLOTS	64
+
+struct minute_slot {
+	int64_t minute;		/* t / 60, floored */
+	bool used;
+	bool recent;
+	char text[TIME_COLUMN_LEN + 1];
+};
+
+struct day_slot {
+	int64_t day;		/* utc day number */
+	bool used;
+	bool fixed;		/* same offset all day */
+	long offset;		/* seconds east of utc */
+};
+
+static const char *months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static __thread struct minute_slot minutes[MINUTE_SLOTS];
+static __thread struct day_slot days[DAY_SLOTS];
+static __thread time_t now;
+static __thread bool initialized;
+
+static bool to_local(time_t t, struct tm *tm);
+static int64_t days_from_civil(int64_t y, int m, int d);
+static void civil_from_days(int64_t z, int64_t *y, int *m, int *d);
+static int64_t floor_div(int64_t a, int64_t b);
+static bool offset_at(time_t t, long *off);
+static void put2(char *p, int v, char pad);
+
+/*time column for t, "Mon dd HH:MM", or "Mon dd  YYYY" when t is more
+than six months old or in the future. NULL if t cant be converted.
+points into the cache, good until the next call*/
+const char *format_time(time_t t){
+	struct minute_slot *ms;
+	struct tm tm;
+	int64_t minute;
+	bool recent;
+	char *p;
+
+	if (!initialized) {
+		tzset();
+		now = time(NULL);
+		initialized = true;
+	}
+	recent = t > now - SIX_MONTHS && t <= now;
+	minute = floor_div((int64_t)t, 60);
+	ms = &minutes[(uint64_t)minute % MINUTE_SLOTS];
+	if (ms->used && ms->minute == minute && ms->recent == recent) {
+		return ms->text;
+	}
+
+	if (!to_local(t, &tm)) {
+		return NULL;
+	}
+	p = ms->text;
+	(void)memcpy(p, months[tm.tm_mon], 3);
+	p[3] = ' ';
+	put2(p + 4, tm.tm_mday, '0');
+	p[6] = ' ';
+	if (recent) {
+		put2(p + 7, tm.tm_hour, '0');
+		p[9] = ':';
+		put2(p + 10, tm.tm_min, '0');
+	} else if (tm.tm_year + 1900 >= 0 && tm.tm_year + 1900 <= 9999) {
+		p[7] = ' ';
+		put2(p + 8, (tm.tm_year + 1900) / 100, '0');
+		put2(p + 10, (tm.tm_year + 1900) % 100, '0');
+	} else {
+		return NULL;
+	}
+	p[TIME_COLUMN_LEN] = '\0';
+	ms->minute = minute;
+	ms->recent = recent;
+	ms->used = true;
+	return ms->text;
+}
+
+/*read the clock again, for --watch and --serve which outlive their
+first "now"*/
+void format_time_now(void){
+	if (!initialized) {
+		tzset();
+		initialized = true;
+	}
+	now = time(NULL);
+}
+
+/*broken down local time, from the cached offset when there is one*/
+static bool to_local(time_t t, struct tm *tm){
+	struct day_slot *ds;
+	int64_t day;
+	int64_t local;
+	int64_t y;
+	int64_t secs;
+	long start_off;
+	long end_off;
+
+	day = floor_div((int64_t)t, 86400);
+	ds = &days[(uint64_t)day % DAY_SLOTS];
+	if (!ds->used || ds->day != day) {
+		if (!offset_at((time_t)(day * 86400), &start_off) ||
+		    !offset_at((time_t)(day * 86400 + 86399), &end_off)) {
+			return false;
+		}
+		ds->day = day;
+		ds->used = true;
+		ds->fixed = start_off == end_off;
+		ds->offset = start_off;
+	}
+	if (!ds->fixed) {
+		return localtime_r(&t, tm) != NULL;
+	}
+
+	local = (int64_t)t + ds->offset;
+	secs = local - floor_div(local, 86400) * 86400;
+	civil_from_days(floor_div(local, 86400), &y, &tm->tm_mon, &tm->tm_mday);
+	tm->tm_mon--;
+	tm->tm_year = (int)(y - 1900);
+	tm->tm_hour = (int)(secs / 3600);
+	tm->tm_min = (int)(secs / 60 % 60);
+	tm->tm_sec = (int)(secs % 60);
+	return true;
+}
+
+/*utc offset in effect at t, via localtime*/
+static bool offset_at(time_t t, long *off){
+	struct tm tm;
+	int64_t local;
+
+	if (localtime_r(&t, &tm) == NULL) {
+		return false;
+	}
+	local = days_from_civil(tm.tm_year + 1900LL, tm.tm_mon + 1, tm.tm_mday) * 86400 +
+	    tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+	*off = (long)(local - (int64_t)t);
+	return true;
+}
+
+/*days since 1970-01-01 of a proleptic gregorian date*/
+static int64_t days_from_civil(int64_t y, int m, int d){
+	int64_t era;
+	int64_t yoe;
+	int64_t doy;
+	int64_t doe;
+
+	y -= m <= 2;
+	era = floor_div(y, 400);
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/*inverse of days_from_civil, m is 1-12*/
+static void civil_from_days(int64_t z, int64_t *y, int *m, int *d){
+	int64_t era;
+	int64_t doe;
+	int64_t yoe;
+	int64_t doy;
+	int64_t mp;
+
+	z += 719468;
+	era = floor_div(z, 146097);
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*d = (int)(doy - (153 * mp + 2) / 5 + 1);
+	*m = (int)(mp < 10 ? mp + 3 : mp - 9);
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static int64_t floor_div(int64_t a, int64_t b){
+	int64_t q = a / b;
+
+	if ((a % b != 0) && ((a < 0) != (b < 0))) {
+		q--;
+	}
+	return q;
+}
+
+/*two digits*/
+static void put2(char *p, int v, char pad){
+	p[0] = v >= 10 ? (char)('0' + v / 10) : pad;
+	p[1] = (char)('0' + v % 10);
+}
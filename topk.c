@@ -0,0 +1,284 @@
+/*topk.c - --head/--tail, the first or last N of a listing*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * Only N entries are ever held. The directory is read and stat'd in
+ * STREAM_BATCH batches like stream.c, and each entry is offered to a
+ * heap of the N best so far, the worst of them at the root: anything
+ * better than the root replaces it. "Better" is the listing order from
+ * compare_time/compare_size/compare_names (read order for -f), flipped
+ * for -r, and flipped again for --tail, which wants the end of the list.
+ * Heap names are malloc'd one by one since evicted names must go.
+ * -R still needs every subdir, those are kept apart in dl->subdirs.
+ */
+
+struct topk_item {
+	struct file_entry fe;
+	uint64_t seq;		/* read order, the -f key */
+};
+
+struct topk_heap {
+	struct topk_item *items;
+	int n;
+	int k;
+	int cap;		/* grows up to k, --head can be huge */
+	int (*cmp)(const void *, const void *);
+	int sign;		/* -1 to flip cmp for -r and --tail */
+	bool unsorted;
+};
+
+static int topk_order(const struct topk_heap *h, const struct topk_item *a,
+    const struct topk_item *b);
+static void topk_offer(struct topk_heap *h, const struct file_entry *fe, uint64_t seq);
+static void sift_up(struct topk_heap *h, int i);
+static void sift_down(struct topk_heap *h, int i, int n);
+static void topk_batch(int fd, const char *path, struct file_entry *files, int count,
+    const int *pending, int npending, const struct meta_plan *mp,
+    const struct options *opts, struct topk_heap *h, uint64_t *seq, struct dir_listing *dl);
+
+/*read the rest of the dir open on fd, through d, keeping the N entries --head or
+--tail asks for. they end up in dl in listing order*/
+void read_topk(struct dents *d, int fd, const char *path, const struct options *opts,
+    const struct meta_plan *mp, struct dir_listing *dl){
+	struct dirent *entry;
+	struct file_entry *files;
+	struct arena names;
+	struct topk_heap h;
+	struct topk_item tmp;
+	int pending[STREAM_BATCH];
+	int npending;
+	int count;
+	uint64_t seq;
+	uint64_t t;
+	uint64_t nread;
+	int i;
+
+	h.k = opts->head > 0 ? opts->head : opts->tail;
+	h.n = 0;
+	h.cap = h.k < STREAM_BATCH ? h.k : STREAM_BATCH;
+	h.unsorted = opts->unsorted;
+	h.sign = (opts->reverse ? -1 : 1) * (opts->tail > 0 ? -1 : 1);
+	if (opts->sort_time) {
+		h.cmp = compare_time;
+	} else if (opts->sort_size) {
+		h.cmp = compare_size;
+	} else {
+		h.cmp = compare_names;
+	}
+	if ((h.items = malloc(h.cap * sizeof(struct topk_item))) == NULL ||
+	    (files = malloc(STREAM_BATCH * sizeof(struct file_entry))) == NULL) {
+		err(1, NULL);
+	}
+	arena_init(&names);
+
+	count = 0;
+	npending = 0;
+	t = stats_now();
+	seq = 0;
+	while ((entry = dents_next(d)) != NULL) {
+		if ((files[count].name = arena_strdup(&names, entry->d_name)) == NULL) {
+			err(1, NULL);
+		}
+		files[count].link = NULL;
+		if (mp->need != 0 && !meta_from_dirent(mp, entry, &files[count].m)) {
+			pending[npending++] = count;
+		}
+		if (++count == STREAM_BATCH) {
+			stats_time(STATS_READ, t, path);
+			topk_batch(fd, path, files, count, pending, npending, mp, opts,
+			    &h, &seq, dl);
+			arena_reset(&names);
+			count = 0;
+			npending = 0;
+			t = stats_now();
+		}
+		/*unsorted --head has all it wants, unless -R needs the subdirs*/
+		if (opts->unsorted && opts->head > 0 && !opts->recursive &&
+		    seq + count >= (uint64_t)h.k) {
+			break;
+		}
+	}
+	stats_time(STATS_READ, t, path);
+	nread = d->nread;
+	stats_add(STATS_ENTRIES, nread);
+	if (count > 0) {
+		topk_batch(fd, path, files, count, pending, npending, mp, opts,
+		    &h, &seq, dl);
+	}
+	arena_free(&names);
+	free(files);
+
+	/*heap sort: the root is the worst, so it goes to the back*/
+	for (i = h.n - 1; i > 0; i--) {
+		tmp = h.items[0];
+		h.items[0] = h.items[i];
+		h.items[i] = tmp;
+		sift_down(&h, 0, i);
+	}
+
+	/*into the listing, --tail wanted the list back to front*/
+	t = stats_now();
+	if ((dl->files = lib_malloc((h.n > 0 ? h.n : 1) * sizeof(struct file_entry))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < h.n; i++) {
+		struct file_entry *fe;
+
+		fe = &dl->files[opts->tail > 0 ? h.n - 1 - i : i];
+		*fe = h.items[i].fe;
+		if ((fe->name = arena_strdup(&dl->names, h.items[i].fe.name)) == NULL) {
+			err(1, NULL);
+		}
+		free(h.items[i].fe.name);
+		/*link targets only for what is shown*/
+		if (wants_link(opts) && S_ISLNK(fe->m.mode)) {
+			stats_add(STATS_READLINKS, 1);
+			fe->link = read_link_at(fd, fe->name, &dl->names);
+		}
+		dl->total_size_bytes += fe->m.size;
+		dl->total_blocks += fe->m.blocks;
+	}
+	dl->count = h.n;
+	free(h.items);
+	stats_time(STATS_STAT, t, path);
+
+	/*-R goes through every subdir, in listing order*/
+	t = stats_now();
+	if (dl->nsubdirs > 1) {
+		sort_entries(dl->subdirs, dl->nsubdirs, opts);
+	}
+	stats_time(STATS_SORT, t, path);
+}
+
+/*stat the pending entries of a batch and offer it to the heap.
+same stat error handling as read_directory_at*/
+static void topk_batch(int fd, const char *path, struct file_entry *files, int count,
+    const int *pending, int npending, const struct meta_plan *mp,
+    const struct options *opts, struct topk_heap *h, uint64_t *seq, struct dir_listing *dl){
+	int errs[STREAM_BATCH];
+	int i;
+	int j;
+	uint64_t t;
+
+	t = stats_now();
+	stats_add(STATS_STATS, npending);
+	if (npending > 0) {
+		meta_stat_batch(fd, files, pending, npending, mp, errs);
+	}
+	j = 0;
+	for (i = 0; i < count; i++) {
+		if (j < npending && pending[j] == i && errs[j++] != 0) {
+			errno = errs[j - 1];
+			out_warn("cannot stat '%s%s%s'", path,
+			    path[strlen(path) - 1] == '/' ? "" : "/", files[i].name);
+			continue;
+		}
+		if (opts->recursive && is_recurse_dir(&files[i], opts)) {
+			keep_subdir(dl, &files[i]);
+		}
+		topk_offer(h, &files[i], (*seq)++);
+	}
+	stats_time(STATS_STAT, t, path);
+	/*the batch and the heap*/
+	stats_peak(count + h->n);
+}
+
+/*negative if a goes before b in what the heap keeps*/
+static int topk_order(const struct topk_heap *h, const struct topk_item *a,
+    const struct topk_item *b){
+	int c;
+
+	if (h->unsorted) {
+		c = a->seq < b->seq ? -1 : a->seq > b->seq;
+	} else {
+		c = h->cmp(&a->fe, &b->fe);
+	}
+	return c * h->sign;
+}
+
+/*keep fe if it is among the best k so far*/
+static void topk_offer(struct topk_heap *h, const struct file_entry *fe, uint64_t seq){
+	struct topk_item item;
+
+	item.fe = *fe;
+	item.seq = seq;
+	if (h->n == h->k) {
+		if (topk_order(h, &item, &h->items[0]) >= 0) {
+			return;
+		}
+		free(h->items[0].fe.name);
+		if ((item.fe.name = strdup(fe->name)) == NULL) {
+			err(1, NULL);
+		}
+		h->items[0] = item;
+		sift_down(h, 0, h->n);
+		return;
+	}
+	if (h->n == h->cap) {
+		struct topk_item *new_items;
+
+		h->cap = h->cap > h->k / 2 ? h->k : h->cap * 2;
+		new_items = realloc(h->items, h->cap * sizeof(struct topk_item));
+		if (new_items == NULL) {
+			err(1, NULL);
+		}
+		h->items = new_items;
+	}
+	if ((item.fe.name = strdup(fe->name)) == NULL) {
+		err(1, NULL);
+	}
+	h->items[h->n] = item;
+	sift_up(h, h->n++);
+}
+
+/*max heap on topk_order, worst kept entry at the root*/
+static void sift_up(struct topk_heap *h, int i){
+	struct topk_item tmp;
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (topk_order(h, &h->items[parent], &h->items[i]) >= 0) {
+			break;
+		}
+		tmp = h->items[parent];
+		h->items[parent] = h->items[i];
+		h->items[i] = tmp;
+		i = parent;
+	}
+}
+
+static void sift_down(struct topk_heap *h, int i, int n){
+	struct topk_item tmp;
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+		if (child + 1 < n &&
+		    topk_order(h, &h->items[child + 1], &h->items[child]) > 0) {
+			child++;
+		}
+		if (topk_order(h, &h->items[i], &h->items[child]) >= 0) {
+			break;
+		}
+		tmp = h->items[i];
+		h->items[i] = h->items[child];
+		h->items[child] = tmp;
+		i = child;
+	}
+}
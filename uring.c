@@ -0,0 +1,358 @@
+/*uring.c - batched statx through io_uring (linux only)*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS) && defined(__NR_io_uring_setup)
+
+/*
+ * No liburing, the rings are driven with the raw syscalls. Each thread
+ * gets its own ring on first use, kept in a pthread key so -j workers
+ * dont share one. If setup fails (old kernel, seccomp, no memlock) the
+ * thread remembers and every batch goes back to the synchronous path.
+ * So does a submit that fails for good mid batch: what is in flight is
+ * reaped first and only entries never completed are stat'd again.
+ */
+
+/*ring entries, also the most stats in flight*/
+#define URING_DEPTH	256
+
+/*EAGAIN/EBUSY in a row, with nothing completing, before giving up*/
+#define URING_STALLS	1000
+
+struct uring {
+	int fd;
+	bool broken;		/* setup or a submit failed, dont try again */
+	int stuck;		/* stats left in flight when it broke */
+
+	/*submission ring*/
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/*completion ring, may share the sq mapping*/
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/*one statx buffer and entry index per slot in flight*/
+	struct statx bufs[URING_DEPTH];
+	int slot_entry[URING_DEPTH];
+	int free_slots[URING_DEPTH];
+	int nfree;
+};
+
+/*set once a kernel turns out to have io_uring but no STATX op*/
+static int no_statx_op;
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+static void uring_key_init(void);
+static void uring_destroy(void *arg);
+static struct uring *uring_get(void);
+static bool uring_setup(struct uring *r);
+static int uring_enter(int fd, unsigned submit, unsigned wait);
+static int uring_reap(struct uring *r, int fd, struct file_entry *files, const int *idx,
+    const struct meta_plan *mp, int *errs, int *inflight);
+static void uring_fail(struct uring *r, int fd, struct file_entry *files, const int *idx,
+    int n, const struct meta_plan *mp, int *errs, int inflight);
+
+/*stat files[idx[i]] for i < n relative to fd. errs[i] gets 0 or errno.
+returns false, having done nothing, if io_uring cant be used*/
+bool uring_stat_batch(int fd, struct file_entry *files, const int *idx, int n,
+    const struct meta_plan *mp, int *errs){
+	struct uring *r;
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	unsigned queued;
+	int inflight;
+	int stalls;
+	int next;
+	int slot;
+	int e;
+	int flags;
+
+	if ((r = uring_get()) == NULL) {
+		return false;
+	}
+	flags = AT_SYMLINK_NOFOLLOW;
+	if (mp->no_sync) {
+		flags |= AT_STATX_DONT_SYNC;
+	}
+	/*-1 until its completion is reaped*/
+	for (e = 0; e < n; e++) {
+		errs[e] = -1;
+	}
+
+	next = 0;
+	inflight = 0;
+	stalls = 0;
+	while (next < n || inflight > 0) {
+		/*fill every free slot*/
+		queued = 0;
+		tail = *r->sq_tail;
+		while (next < n && r->nfree > 0) {
+			slot = r->free_slots[--r->nfree];
+			r->slot_entry[slot] = next;
+			sqe = &r->sqes[tail & *r->sq_mask];
+			(void)memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)files[idx[next]].name;
+			sqe->len = mp->mask;
+			sqe->off = (uintptr_t)&r->bufs[slot];
+			sqe->statx_flags = flags;
+			sqe->user_data = slot;
+			r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+			tail++;
+			queued++;
+			next++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+		inflight += queued;
+
+		/*submit all the kernel hasnt taken yet, an EINTR may have left
+		some. EAGAIN and EBUSY are a full ring or short memory: reap
+		and go around, unless nothing ever comes back*/
+		queued = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (uring_enter(r->fd, queued, 1) < 0 && errno != EINTR &&
+		    ((errno != EAGAIN && errno != EBUSY) || ++stalls > URING_STALLS)) {
+			uring_fail(r, fd, files, idx, n, mp, errs, inflight);
+			return true;
+		}
+		if (uring_reap(r, fd, files, idx, mp, errs, &inflight) > 0) {
+			stalls = 0;
+		}
+		/*no STATX op, the rest go the synchronous way*/
+		if (r->broken) {
+			uring_fail(r, fd, files, idx, n, mp, errs, inflight);
+			return true;
+		}
+	}
+	return true;
+}
+
+/*take every completion the ring has, in any order. how many*/
+static int uring_reap(struct uring *r, int fd, struct file_entry *files, const int *idx,
+    const struct meta_plan *mp, int *errs, int *inflight){
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int slot;
+	int e;
+	int got;
+
+	got = 0;
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		slot = (int)cqe->user_data;
+		e = r->slot_entry[slot];
+		if (cqe->res == 0) {
+			meta_from_statx(&r->bufs[slot], mp, &files[idx[e]].m);
+			errs[e] = 0;
+		} else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+			/*kernel has io_uring but no STATX op (5.1 to 5.5),
+			no ring on any thread is worth using*/
+			__atomic_store_n(&no_statx_op, 1, __ATOMIC_RELAXED);
+			r->broken = true;
+			errs[e] = 0;
+			if (meta_stat_at(fd, files[idx[e]].name, mp, &files[idx[e]].m) < 0) {
+				errs[e] = errno;
+			}
+		} else {
+			errs[e] = -cqe->res;
+		}
+		r->free_slots[r->nfree++] = slot;
+		(*inflight)--;
+		got++;
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return got;
+}
+
+/*the ring is unusable. wait out what the kernel still has, as far as
+it will let us, then stat by hand only the entries never reaped*/
+static void uring_fail(struct uring *r, int fd, struct file_entry *files, const int *idx,
+    int n, const struct meta_plan *mp, int *errs, int inflight){
+	int e;
+
+	r->broken = true;
+	/*sqes the kernel never took are not coming back*/
+	inflight -= (int)(*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+	(void)uring_reap(r, fd, files, idx, mp, errs, &inflight);
+	while (inflight > 0) {
+		if (uring_enter(r->fd, 0, (unsigned)inflight) < 0 && errno != EINTR) {
+			break;
+		}
+		(void)uring_reap(r, fd, files, idx, mp, errs, &inflight);
+	}
+	/*slots the kernel may still write into, r is kept for them*/
+	r->stuck = inflight;
+	for (e = 0; e < n; e++) {
+		if (errs[e] != -1) {
+			continue;
+		}
+		errs[e] = 0;
+		if (meta_stat_at(fd, files[idx[e]].name, mp, &files[idx[e]].m) < 0) {
+			errs[e] = errno;
+		}
+	}
+}
+
+static void uring_key_init(void){
+	(void)pthread_key_create(&uring_key, uring_destroy);
+}
+
+/*this threads ring, set up on first use. NULL if unusable*/
+static struct uring *uring_get(void){
+	struct uring *r;
+
+	if (__atomic_load_n(&no_statx_op, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	(void)pthread_once(&uring_once, uring_key_init);
+	if ((r = pthread_getspecific(uring_key)) == NULL) {
+		if ((r = calloc(1, sizeof(struct uring))) == NULL) {
+			return NULL;
+		}
+		r->fd = -1;
+		if (!uring_setup(r)) {
+			r->broken = true;
+		}
+		(void)pthread_setspecific(uring_key, r);
+	}
+	return r->broken ? NULL : r;
+}
+
+static bool uring_setup(struct uring *r){
+	struct io_uring_params p;
+	unsigned char *sq;
+	unsigned char *cq;
+	int i;
+
+	(void)memset(&p, 0, sizeof(p));
+	if ((r->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p)) < 0) {
+		return false;
+	}
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size) {
+			r->sq_size = r->cq_size;
+		}
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		return false;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			return false;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return false;
+	}
+
+	sq = r->sq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq = r->cq_ptr;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/*never more in flight than either ring holds*/
+	r->nfree = 0;
+	for (i = 0; i < URING_DEPTH && (unsigned)i < p.sq_entries; i++) {
+		r->free_slots[r->nfree++] = i;
+	}
+	return true;
+}
+
+/*thread exit, unmap and close*/
+static void uring_destroy(void *arg){
+	struct uring *r = arg;
+
+	if (r->sqes != NULL) {
+		(void)munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) {
+		(void)munmap(r->cq_ptr, r->cq_size);
+	}
+	if (r->sq_ptr != NULL) {
+		(void)munmap(r->sq_ptr, r->sq_size);
+	}
+	if (r->fd >= 0) {
+		(void)close(r->fd);
+	}
+	/*the kernel could still write a stuck stat into bufs*/
+	if (r->stuck == 0) {
+		free(r);
+	}
+}
+
+/*submit and wait for at least wait completions*/
+static int uring_enter(int fd, unsigned submit, unsigned wait){
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait,
+	    IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+#else /* no io_uring */
+
+bool uring_stat_batch(int fd, struct file_entry *files, const int *idx, int n,
+    const struct meta_plan *mp, int *errs){
+	(void)fd;
+	(void)files;
+	(void)idx;
+	(void)n;
+	(void)mp;
+	(void)errs;
+	return false;
+}
+
+#endif
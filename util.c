@@ -4,47 +4,25 @@
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "ls.h"
 
-/*Compare by modification (m)time*/
-int compare_timem(const void *a, const void *b) {
+/*Compare by the -t time, m/a/c picked when the entry was read*/
+int compare_time(const void *a, const void *b) {
 	const struct file_entry *fa = (const struct file_entry *)a;
 	const struct file_entry *fb = (const struct file_entry *)b;
-	if (fa->sb.st_mtime > fb->sb.st_mtime) {
+	if (fa->m.time > fb->m.time) {
 		return -1;
 	} 
-	else if (fa->sb.st_mtime < fb->sb.st_mtime) {
-		return 1;
-	}
-	return strcmp(fa->name, fb->name);
-}
-/*Compare by access (a)time*/
-int compare_timea(const void *a, const void *b) {
-	const struct file_entry *fa = (const struct file_entry *)a;
-	const struct file_entry *fb = (const struct file_entry *)b;
-	if (fa->sb.st_atime > fb->sb.st_atime) {
-		return -1;
-	} 
-	else if (fa->sb.st_atime < fb->sb.st_atime) {
-		return 1;
-	}
-	return strcmp(fa->name, fb->name);
-}
-/*Compare by status change (c)time*/
-int compare_timec(const void *a, const void *b) {
-	const struct file_entry *fa = (const struct file_entry *)a;
-	const struct file_entry *fb = (const struct file_entry *)b;
-	if (fa->sb.st_ctime > fb->sb.st_ctime) {
-		return -1;
-	} 
-	else if (fa->sb.st_ctime < fb->sb.st_ctime) {
+	else if (fa->m.time < fb->m.time) {
 		return 1;
 	}
 	return strcmp(fa->name, fb->name);
@@ -54,9 +32,9 @@ int compare_size(const void *a, const void *b) {
 	const struct file_entry *fa = (const struct file_entry *)a;
 	const struct file_entry *fb = (const struct file_entry *)b;
 
-	if (fa->sb.st_size > fb->sb.st_size) {
+	if (fa->m.size > fb->m.size) {
 		return -1;
-	} else if (fa->sb.st_size < fb->sb.st_size) {
+	} else if (fa->m.size < fb->m.size) {
 		return 1;
 	}
 	return strcmp(fa->name, fb->name);
@@ -83,7 +61,8 @@ bool is_directory(const char *path) {
 }
 
 /*Build full path from directory and filename.
- caller frees whats returned*/
+ only for display and parallel -R, traversal is fd relative so there is
+ no PATH_MAX limit here. caller frees whats returned*/
 char * build_path(const char *dir, const char *file){
 	char *path;
 	size_t dir_len;
@@ -94,10 +73,6 @@ char * build_path(const char *dir, const char *file){
 	file_len = strlen(file);
 
 	total_len = dir_len + 1 + file_len + 1;
-	if (total_len > PATH_MAX) {
-		errno = ENAMETOOLONG;
-		return NULL;
-	}
 
 	if ((path = malloc(total_len)) == NULL) {
 		return NULL;
@@ -113,6 +88,20 @@ char * build_path(const char *dir, const char *file){
 	return path;
 }
 
+/*symlink target of name relative to dir fd (or AT_FDCWD).
+ returns a string in arena a, or NULL if it cant be read or stored*/
+char *read_link_at(int fd, const char *name, struct arena *a){
+	char linkbuf[PATH_MAX];
+	ssize_t len;
+
+	len = readlinkat(fd, name, linkbuf, sizeof(linkbuf) - 1);
+	if (len < 0) {
+		return NULL;
+	}
+	linkbuf[len] = '\0';
+	return arena_strdup(a, linkbuf);
+}
+
 /*helper to comp two file entries by name for alphabetic sort*/
 int compare_names(const void *a, const void *b) {
 	const struct file_entry *fa;
@@ -122,8 +111,8 @@ int compare_names(const void *a, const void *b) {
 	return strcmp(fa->name, fb->name);
 }
 
-uint64_t get_display_block_size(const struct stat *sb, const struct options *opts) {
-    uint64_t blocks = sb->st_blocks;  //st_blocks is in 512-byte units
+uint64_t get_display_block_size(const struct entry_meta *m, const struct options *opts) {
+    uint64_t blocks = m->blocks;  //blocks is in 512-byte units
     //conv to bytes
     uint64_t bytes = blocks * 512;
     //-h or -k
@@ -156,17 +145,13 @@ void sort_entries(struct file_entry *entries, int count, const struct options *o
 	if (opts->unsorted) {
 		return;
 	}
+	/*big listings sort precomputed keys instead, see sort.c*/
+	if (count >= SORT_KEYED_MIN && sort_entries_keyed(entries, count, opts)) {
+		return;
+	}
 	/*choose sort function*/
 	if (opts->sort_time) {
-		if(opts->use_atime){
-			qsort(entries, count, sizeof(struct file_entry), compare_timea);
-		}
-		else if(opts->use_ctime){
-			qsort(entries, count, sizeof(struct file_entry), compare_timec);
-		}
-		else {
-			qsort(entries, count, sizeof(struct file_entry), compare_timem);
-		}
+		qsort(entries, count, sizeof(struct file_entry), compare_time);
 	} 
 	else if (opts->sort_size) {
 		qsort(entries, count, sizeof(struct file_entry), compare_size);
@@ -181,3 +166,117 @@ void sort_entries(struct file_entry *entries, int count, const struct options *o
 	}
 }
 
+
+/*chunk sizes for arenas, small dirs stay small, big ones grow*/
+#define ARENA_MIN_CHUNK	(4 * 1024)
+#define ARENA_MAX_CHUNK	(1024 * 1024)
+
+static bool arena_chunk_new(struct arena *a, size_t len);
+
+void arena_init(struct arena *a){
+	a->chunks = NULL;
+	a->ptr = NULL;
+	a->left = 0;
+}
+
+/*copy of s in arena a, freed with the arena. NULL if out of memory*/
+char *arena_strdup(struct arena *a, const char *s){
+	size_t len;
+	char *p;
+
+	len = strlen(s) + 1;
+	if (len > a->left && !arena_chunk_new(a, len)) {
+		return NULL;
+	}
+	p = a->ptr;
+	(void)memcpy(p, s, len);
+	a->ptr += len;
+	a->left -= len;
+	return p;
+}
+
+/*size bytes in arena a, 8 byte aligned. NULL if out of memory*/
+void *arena_alloc(struct arena *a, size_t size){
+	size_t pad;
+	char *p;
+
+	pad = (8 - ((uintptr_t)a->ptr & 7)) & 7;
+	if (size + pad > a->left) {
+		if (!arena_chunk_new(a, size)) {
+			return NULL;
+		}
+		pad = 0;
+	}
+	p = a->ptr + pad;
+	a->ptr = p + size;
+	a->left -= size + pad;
+	return p;
+}
+
+/*aligned bytes arena_alloc can hand out without a new chunk*/
+size_t arena_avail(const struct arena *a){
+	size_t pad;
+
+	pad = (8 - ((uintptr_t)a->ptr & 7)) & 7;
+	return a->left > pad ? a->left - pad : 0;
+}
+
+/*give back the end of the last arena_alloc, used bytes of size kept*/
+void arena_trim(struct arena *a, void *p, size_t size, size_t used){
+	if ((char *)p + size == a->ptr) {
+		a->ptr = (char *)p + used;
+		a->left += size - used;
+	}
+}
+
+/*new current chunk with room for at least len, false if there is
+no memory for it*/
+static bool arena_chunk_new(struct arena *a, size_t len){
+	struct arena_chunk *c;
+	size_t size;
+
+	/*double the last chunk, up to the max*/
+	size = a->chunks == NULL ? ARENA_MIN_CHUNK : a->chunks->size * 2;
+	if (size > ARENA_MAX_CHUNK) {
+		size = ARENA_MAX_CHUNK;
+	}
+	if (size < len) {
+		size = len;
+	}
+	if ((c = lib_malloc(sizeof(struct arena_chunk) + size)) == NULL) {
+		return false;
+	}
+	c->size = size;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->ptr = c->data;
+	a->left = size;
+	return true;
+}
+
+/*forget everything but keep the newest chunk, the biggest, for reuse*/
+void arena_reset(struct arena *a){
+	struct arena_chunk *c;
+
+	if (a->chunks == NULL) {
+		return;
+	}
+	while ((c = a->chunks->next) != NULL) {
+		a->chunks->next = c->next;
+		lib_free(c);
+	}
+	a->ptr = a->chunks->data;
+	a->left = a->chunks->size;
+}
+
+/*free every chunk*/
+void arena_free(struct arena *a){
+	struct arena_chunk *c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		lib_free(c);
+	}
+	a->ptr = NULL;
+	a->left = 0;
+}
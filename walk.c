@@ -0,0 +1,419 @@
+/*walk.c - parallel -R traversal for -j*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+/*
+ * Workers read, stat and sort directories; the calling thread prints.
+ * Each worker owns a deque of pending directories: it pushes the subdirs
+ * it finds and pops from the same end, so it runs roughly in output
+ * order, while idle workers steal from the other end. The printer walks
+ * the tree depth first exactly like process_recursively and waits on
+ * each node until its listing is done, so output is byte identical.
+ *
+ * Workers only get so far ahead of the printer: past WALK_AHEAD_DIRS
+ * listings or WALK_AHEAD_ENTRIES entries read and not yet printed they
+ * wait before taking another dir. A node is claimed by whoever reads
+ * it, and the printer reads the one it wants itself if no worker has
+ * taken it, so workers held back never hold up the printer. A node so
+ * read is still on some deque, so it is freed by the last of the
+ * printer and the worker that pops it.
+ *
+ * --du always walks here, with one worker if there is no -j. The
+ * printer adds up each subtree on its way back up and prints the sum
+ * after it. Without -R only the top dir is printed, the rest is read
+ * for the totals alone, and past --max-depth the same: -R alone stops
+ * there, --du reads on and prints no deeper.
+ */
+
+/*done listings the printer has yet to get to before workers wait*/
+#define WALK_AHEAD_DIRS	1024
+#define WALK_AHEAD_ENTRIES	(64 * 1024)
+
+/*one directory of the walk*/
+struct walk_node {
+	char *path;
+	int depth;		/* below the operand */
+	struct dir_listing dl;
+	bool ok;
+	bool done;
+	int claimed;		/* set by the one reading it, atomic */
+	int refs;		/* its deque and the printer, atomic */
+	struct walk_node **children;
+	int nchildren;
+};
+
+/*per worker deque, items live in [head, tail)*/
+struct walk_deque {
+	pthread_mutex_t lock;
+	struct walk_node **items;
+	size_t head;
+	size_t tail;
+	size_t cap;
+};
+
+struct walk_worker {
+	struct walk_pool *pool;
+	struct walk_deque dq;
+	int id;
+	pthread_t thread;
+};
+
+struct walk_pool {
+	const struct options *opts;
+	struct outctx *out;	/* where the caller's warnings go */
+	struct walk_worker *workers;
+	int nworkers;
+
+	/*idle workers sleep here until something is queued*/
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	long pending;
+	bool shutdown;
+
+	/*printer sleeps here until the node it wants is done, workers
+	on room_cond while too far ahead of it*/
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	pthread_cond_t room_cond;
+	long ahead_dirs;	/* done and not printed */
+	uint64_t ahead_entries;
+};
+
+static void *worker_main(void *arg);
+static void read_node(struct walk_worker *self, struct walk_node *node);
+static void emit_node(struct walk_pool *pool, struct walk_node *node, bool print_name,
+    bool show, struct du_total *du);
+static struct walk_node *new_node(char *path, int depth);
+static void release_node(struct walk_node *node);
+static void deque_push(struct walk_deque *dq, struct walk_node *node);
+static struct walk_node *deque_pop(struct walk_deque *dq);
+static struct walk_node *deque_steal(struct walk_deque *dq);
+static void queue_node(struct walk_pool *pool, struct walk_worker *w, struct walk_node *node);
+
+/*-R with opts->jobs worker threads, output same as process_recursively.
+also --du, with or without -R*/
+void process_recursively_parallel(const char *path, const struct options *opts, bool print_name) {
+	struct walk_pool pool;
+	struct walk_node *root;
+	struct walk_node *node;
+	struct du_total du;
+	char *rootpath;
+	int i;
+
+	pool.opts = opts;
+	pool.out = out_current();
+	pool.nworkers = opts->jobs > 1 ? opts->jobs : 1;
+	pool.pending = 0;
+	pool.shutdown = false;
+	pthread_mutex_init(&pool.idle_lock, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+	pthread_mutex_init(&pool.done_lock, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+	pthread_cond_init(&pool.room_cond, NULL);
+	pool.ahead_dirs = 0;
+	pool.ahead_entries = 0;
+
+	if ((pool.workers = calloc(pool.nworkers, sizeof(struct walk_worker))) == NULL) {
+		err(1, NULL);
+	}
+	for (i = 0; i < pool.nworkers; i++) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		pthread_mutex_init(&pool.workers[i].dq.lock, NULL);
+	}
+
+	if ((rootpath = strdup(path)) == NULL) {
+		err(1, NULL);
+	}
+	root = new_node(rootpath, 0);
+	queue_node(&pool, &pool.workers[0], root);
+
+	for (i = 0; i < pool.nworkers; i++) {
+		if ((errno = pthread_create(&pool.workers[i].thread, NULL,
+		    worker_main, &pool.workers[i])) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+
+	/*print in order, frees every node on the way*/
+	emit_node(&pool, root, print_name, true, &du);
+
+	pthread_mutex_lock(&pool.idle_lock);
+	pool.shutdown = true;
+	pthread_cond_broadcast(&pool.idle_cond);
+	pthread_mutex_unlock(&pool.idle_lock);
+	for (i = 0; i < pool.nworkers; i++) {
+		pthread_join(pool.workers[i].thread, NULL);
+		/*left behind by nodes the printer read*/
+		while ((node = deque_pop(&pool.workers[i].dq)) != NULL) {
+			release_node(node);
+		}
+		pthread_mutex_destroy(&pool.workers[i].dq.lock);
+		free(pool.workers[i].dq.items);
+	}
+	free(pool.workers);
+	pthread_mutex_destroy(&pool.idle_lock);
+	pthread_cond_destroy(&pool.idle_cond);
+	pthread_mutex_destroy(&pool.done_lock);
+	pthread_cond_destroy(&pool.done_cond);
+	pthread_cond_destroy(&pool.room_cond);
+}
+
+/*worker loop: own deque first, then steal, then sleep*/
+static void *worker_main(void *arg) {
+	struct walk_worker *self = arg;
+	struct walk_pool *pool = self->pool;
+	struct walk_node *node;
+	int i;
+
+	/*a stat warning from read_directory goes to the same stderr*/
+	out_use(pool->out);
+	for (;;) {
+		node = deque_pop(&self->dq);
+		/*steal from the others, starting at the next worker*/
+		for (i = 1; node == NULL && i < pool->nworkers; i++) {
+			node = deque_steal(&pool->workers[(self->id + i) % pool->nworkers].dq);
+		}
+
+		pthread_mutex_lock(&pool->idle_lock);
+		if (node != NULL) {
+			pool->pending--;
+			pthread_mutex_unlock(&pool->idle_lock);
+			/*hold off while far enough ahead, the printer may
+			take the node meanwhile*/
+			pthread_mutex_lock(&pool->done_lock);
+			while (pool->ahead_dirs >= WALK_AHEAD_DIRS ||
+			    pool->ahead_entries >= WALK_AHEAD_ENTRIES) {
+				pthread_cond_wait(&pool->room_cond, &pool->done_lock);
+			}
+			pthread_mutex_unlock(&pool->done_lock);
+			if (__atomic_exchange_n(&node->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+				read_node(self, node);
+			}
+			release_node(node);
+			continue;
+		}
+		/*nothing queued, wait; pending can be nonzero if a
+		steal raced with a pop, then just go around again*/
+		while (pool->pending == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+		}
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->idle_lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+/*read one dir, queue its subdirs on this worker and mark it done*/
+static void read_node(struct walk_worker *self, struct walk_node *node) {
+	struct walk_pool *pool = self->pool;
+	struct file_entry *subdirs;
+	int nsubdirs;
+	char *fullpath;
+	int capacity;
+	int i;
+
+	node->ok = read_directory(node->path, pool->opts, &node->dl);
+	if (node->ok) {
+		/*--head/--tail listings keep every subdir apart*/
+		subdirs = node->dl.files;
+		nsubdirs = node->dl.count;
+		if (node->dl.subdirs != NULL) {
+			subdirs = node->dl.subdirs;
+			nsubdirs = node->dl.nsubdirs;
+		}
+		capacity = 0;
+		if (!pool->opts->du && !is_within_depth(node->depth + 1, pool->opts)) {
+			nsubdirs = 0;
+		}
+		for (i = 0; i < nsubdirs; i++) {
+			if (!is_recurse_dir(&subdirs[i], pool->opts)) {
+				continue;
+			}
+			if (node->nchildren >= capacity) {
+				struct walk_node **new_children;
+
+				capacity = capacity == 0 ? 16 : capacity * 2;
+				new_children = realloc(node->children,
+				    capacity * sizeof(struct walk_node *));
+				if (new_children == NULL) {
+					err(1, NULL);
+				}
+				node->children = new_children;
+			}
+			fullpath = build_path(node->path, subdirs[i].name);
+			if (fullpath == NULL) {
+				err(1, NULL);
+			}
+			node->children[node->nchildren++] = new_node(fullpath, node->depth + 1);
+		}
+		/*push last child first so the first one is popped next*/
+		for (i = node->nchildren - 1; i >= 0; i--) {
+			queue_node(pool, self, node->children[i]);
+		}
+	}
+
+	pthread_mutex_lock(&pool->done_lock);
+	node->done = true;
+	pool->ahead_dirs++;
+	pool->ahead_entries += (uint64_t)node->dl.count;
+	pthread_cond_signal(&pool->done_cond);
+	pthread_mutex_unlock(&pool->done_lock);
+}
+
+/*print node and its subtree in process_recursively order, or only
+wait for and free them if not show. du gets the subtree's sums*/
+static void emit_node(struct walk_pool *pool, struct walk_node *node, bool print_name,
+    bool show, struct du_total *du) {
+	struct du_total kid;
+	bool shown_kids;
+	int i;
+
+	/*directory name if, --json has full paths instead*/
+	if (show && print_name && !pool->opts->json) {
+		out_str(node->path);
+		out_char(':');
+		out_eol();
+	}
+
+	/*not taken by a worker yet, read it here rather than wait*/
+	if (__atomic_exchange_n(&node->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+		read_node(&pool->workers[0], node);
+	}
+	pthread_mutex_lock(&pool->done_lock);
+	while (!node->done) {
+		pthread_cond_wait(&pool->done_cond, &pool->done_lock);
+	}
+	/*the listing is freed below, let a worker go on*/
+	pool->ahead_dirs--;
+	pool->ahead_entries -= (uint64_t)node->dl.count;
+	pthread_cond_broadcast(&pool->room_cond);
+	pthread_mutex_unlock(&pool->done_lock);
+
+	if (!node->ok) {
+		errno = node->dl.error;
+		out_warn("cannot access '%s'", node->path);
+	} else {
+		if (pool->opts->du) {
+			du_credit(&node->dl);
+		}
+		if (show) {
+			print_directory(&node->dl, pool->opts);
+		}
+		free_listing(&node->dl);
+	}
+	*du = node->dl.du;
+
+	/*subdirs are only printed with -R*/
+	shown_kids = show && pool->opts->recursive && node->nchildren > 0 &&
+	    is_within_depth(node->depth + 1, pool->opts);
+	for (i = 0; i < node->nchildren; i++) {
+		if (shown_kids && !pool->opts->json) {
+			out_eol();
+		}
+		emit_node(pool, node->children[i], true, shown_kids, &kid);
+		du->blocks += kid.blocks;
+		du->bytes += kid.bytes;
+		du->entries += kid.entries;
+	}
+	if (show && pool->opts->du) {
+		if (shown_kids && !pool->opts->json) {
+			out_eol();
+		}
+		print_du(node->path, du, pool->opts);
+	}
+	free(node->children);
+	free(node->path);
+	release_node(node);
+}
+
+/*node for path, takes ownership of path*/
+static struct walk_node *new_node(char *path, int depth) {
+	struct walk_node *node;
+
+	if ((node = calloc(1, sizeof(struct walk_node))) == NULL) {
+		err(1, NULL);
+	}
+	node->path = path;
+	node->depth = depth;
+	node->refs = 2;
+	return node;
+}
+
+/*drop one of the node's two references, the last frees it*/
+static void release_node(struct walk_node *node) {
+	if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(node);
+	}
+}
+
+/*queue node on worker w and wake a sleeper*/
+static void queue_node(struct walk_pool *pool, struct walk_worker *w, struct walk_node *node) {
+	deque_push(&w->dq, node);
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->pending++;
+	pthread_cond_signal(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void deque_push(struct walk_deque *dq, struct walk_node *node) {
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail >= dq->cap) {
+		/*slide down first, grow only if that doesnt free space*/
+		if (dq->head > 0) {
+			memmove(dq->items, dq->items + dq->head,
+			    (dq->tail - dq->head) * sizeof(struct walk_node *));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		}
+		if (dq->tail >= dq->cap) {
+			struct walk_node **new_items;
+
+			dq->cap = dq->cap == 0 ? 64 : dq->cap * 2;
+			new_items = realloc(dq->items, dq->cap * sizeof(struct walk_node *));
+			if (new_items == NULL) {
+				err(1, NULL);
+			}
+			dq->items = new_items;
+		}
+	}
+	dq->items[dq->tail++] = node;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/*owner end*/
+static struct walk_node *deque_pop(struct walk_deque *dq) {
+	struct walk_node *node = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		node = dq->items[--dq->tail];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return node;
+}
+
+/*thief end*/
+static struct walk_node *deque_steal(struct walk_deque *dq) {
+	struct walk_node *node = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		node = dq->items[dq->head++];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return node;
+}
@@ -0,0 +1,648 @@
+/*watch.c - --watch, list once then follow inotify*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+/*
+ * Each watched dir is a node holding its sorted listing and dir fd,
+ * with an inotify watch on it. Events only collect names; once they
+ * stop coming for WATCH_SETTLE_MS the changed names, and nothing
+ * else, are stat'd again. Their old entries are dropped, the new ones
+ * sorted on their own and merged in, and the whole thing is printed
+ * again. With -R subdirs get nodes of their own as they show up.
+ *
+ * Changes are applied in two passes over the nodes, stats and drops
+ * first, new subdirs second, so a dir moved from one watched parent
+ * to another loses its old watch before it gets its new one (inotify
+ * hands out the same wd for the same inode).
+ */
+
+#ifdef __linux__
+
+/*quiet time that ends a burst of events, and the longest wait*/
+#define WATCH_SETTLE_MS	50
+#define WATCH_MAX_ROUNDS	20
+/*dead names in an arena before it is rebuilt*/
+#define WATCH_GARBAGE_MIN	1024
+
+struct watch_node {
+	char *path;
+	char *name;		/* in the parent, NULL for a root */
+	int wd;			/* -1 if it could not be watched */
+	struct dir_listing dl;	/* with the dir fd */
+	struct watch_node *parent;
+	int depth;		/* below the root, for --max-depth */
+	struct watch_node **kids;
+	int nkids;
+	int kids_cap;
+	char **changed;		/* names from events since the last pass */
+	int nchanged;
+	int changed_cap;
+	struct file_entry *add;	/* their new entries, between the passes */
+	int nadd;
+	int garbage;		/* names in dl.names no entry points to */
+};
+
+static const struct options *wopts;
+static struct meta_plan plan;
+static int ifd = -1;
+static uint32_t watch_mask;
+static struct watch_node **by_wd;
+static int by_wd_cap;
+static struct watch_node **roots;
+static int nroots;
+static char *const *root_paths;
+static int nroot_paths;
+static bool rescan;
+static bool watch_full;
+
+static struct watch_node *node_open(struct watch_node *parent, int atfd,
+    const char *name, const char *path);
+static void node_free(struct watch_node *node);
+static void node_detach(struct watch_node *node);
+static void kid_add(struct watch_node *parent, struct watch_node *kid);
+static struct watch_node *kid_find(const struct watch_node *node, const char *name);
+static void open_roots(void);
+static void close_roots(void);
+static void drop_removed_roots(void);
+static bool wait_events(void);
+static void read_events(void);
+static void note_change(struct watch_node *node, const char *name);
+static void restat(struct watch_node *node);
+static void merge(struct watch_node *node);
+static void compact(struct watch_node *node);
+static int entry_cmp(const struct file_entry *a, const struct file_entry *b);
+static int name_cmp(const void *a, const void *b);
+static void render(void);
+static void render_node(const struct watch_node *node, bool print_name);
+
+/*list paths, then again on every change. returns when nothing is left*/
+void watch_run(char *const paths[], int n, const struct options *opts){
+	bool first;
+	int i;
+
+	wopts = opts;
+	meta_plan(opts, &plan);
+	watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	    IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR;
+	/*sizes and times only matter when they are shown or sorted on*/
+	if (plan.need & META_STAT) {
+		watch_mask |= IN_MODIFY;
+	}
+	if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+		warn("inotify_init1");
+		return;
+	}
+	root_paths = paths;
+	nroot_paths = n;
+	open_roots();
+
+	first = true;
+	while (nroots > 0) {
+		if (!first && !wopts->json && !isatty(STDOUT_FILENO)) {
+			out_eol();
+		}
+		first = false;
+		render();
+		if (!wait_events()) {
+			break;
+		}
+		if (rescan) {
+			/*events were lost, start over*/
+			close_roots();
+			open_roots();
+			rescan = false;
+			continue;
+		}
+		for (i = 0; i < by_wd_cap; i++) {
+			if (by_wd[i] != NULL && by_wd[i]->nchanged > 0) {
+				restat(by_wd[i]);
+			}
+		}
+		for (i = 0; i < by_wd_cap; i++) {
+			if (by_wd[i] != NULL && by_wd[i]->nchanged > 0) {
+				merge(by_wd[i]);
+			}
+		}
+		drop_removed_roots();
+	}
+	close_roots();
+	(void)close(ifd);
+}
+
+/*node for dir name relative to atfd, watched before it is read so
+nothing falls in between. with -R its subdirs too. NULL on errors*/
+static struct watch_node *node_open(struct watch_node *parent, int atfd,
+    const char *name, const char *path){
+	struct watch_node *node;
+	char proc[64];
+	char *kidpath;
+	int fd;
+	int wd;
+	int i;
+
+	if ((fd = openat(atfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		warn("cannot access '%s'", path);
+		return NULL;
+	}
+	/*by fd, so long and moving paths dont matter*/
+	(void)snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if ((wd = inotify_add_watch(ifd, proc, watch_mask)) < 0) {
+		if (errno != ENOSPC) {
+			warn("cannot watch '%s'", path);
+		} else if (!watch_full) {
+			warnx("inotify watch limit reached, '%s' and later dirs not followed", path);
+			watch_full = true;
+		}
+	} else if (wd < by_wd_cap && by_wd[wd] != NULL) {
+		/*same dir twice, it is already there*/
+		(void)close(fd);
+		return NULL;
+	}
+	if ((node = calloc(1, sizeof(*node))) == NULL ||
+	    (node->path = strdup(path)) == NULL ||
+	    (parent != NULL && (node->name = strdup(name)) == NULL)) {
+		err(1, NULL);
+	}
+	node->wd = wd;
+	node->parent = parent;
+	node->depth = parent != NULL ? parent->depth + 1 : 0;
+	if (!read_directory_at(fd, ".", node->path, wopts, true, &node->dl)) {
+		errno = node->dl.error;
+		warn("cannot access '%s'", path);
+		(void)close(fd);
+		if (wd >= 0) {
+			(void)inotify_rm_watch(ifd, wd);
+		}
+		free(node->name);
+		free(node->path);
+		free(node);
+		return NULL;
+	}
+	(void)close(fd);
+	if (wd >= 0) {
+		if (wd >= by_wd_cap) {
+			struct watch_node **new_by_wd;
+			int cap;
+
+			cap = by_wd_cap == 0 ? 64 : by_wd_cap;
+			while (cap <= wd) {
+				cap *= 2;
+			}
+			if ((new_by_wd = realloc(by_wd, cap * sizeof(*by_wd))) == NULL) {
+				err(1, NULL);
+			}
+			(void)memset(new_by_wd + by_wd_cap, 0, (cap - by_wd_cap) * sizeof(*by_wd));
+			by_wd = new_by_wd;
+			by_wd_cap = cap;
+		}
+		by_wd[wd] = node;
+	}
+	if (wopts->recursive && is_within_depth(node->depth + 1, wopts)) {
+		for (i = 0; i < node->dl.count; i++) {
+			struct watch_node *kid;
+
+			if (!is_recurse_dir(&node->dl.files[i], wopts)) {
+				continue;
+			}
+			if ((kidpath = build_path(path, node->dl.files[i].name)) == NULL) {
+				err(1, NULL);
+			}
+			kid = node_open(node, node->dl.fd, node->dl.files[i].name, kidpath);
+			if (kid != NULL) {
+				kid_add(node, kid);
+			}
+			free(kidpath);
+		}
+	}
+	return node;
+}
+
+/*node and everything below it, unwatched*/
+static void node_free(struct watch_node *node){
+	int i;
+
+	for (i = 0; i < node->nkids; i++) {
+		node_free(node->kids[i]);
+	}
+	if (node->wd >= 0) {
+		(void)inotify_rm_watch(ifd, node->wd);
+		by_wd[node->wd] = NULL;
+	}
+	for (i = 0; i < node->nchanged; i++) {
+		free(node->changed[i]);
+	}
+	free_listing(&node->dl);
+	free(node->add);
+	free(node->changed);
+	free(node->kids);
+	free(node->name);
+	free(node->path);
+	free(node);
+}
+
+/*take node out of its parent, or out of the roots*/
+static void node_detach(struct watch_node *node){
+	struct watch_node **list;
+	int *n;
+	int i;
+
+	if (node->parent != NULL) {
+		list = node->parent->kids;
+		n = &node->parent->nkids;
+	} else {
+		list = roots;
+		n = &nroots;
+	}
+	for (i = 0; i < *n; i++) {
+		if (list[i] == node) {
+			(void)memmove(&list[i], &list[i + 1], (*n - i - 1) * sizeof(*list));
+			--*n;
+			break;
+		}
+	}
+}
+
+static void kid_add(struct watch_node *parent, struct watch_node *kid){
+	if (parent->nkids >= parent->kids_cap) {
+		struct watch_node **new_kids;
+
+		parent->kids_cap = parent->kids_cap == 0 ? 8 : parent->kids_cap * 2;
+		new_kids = realloc(parent->kids, parent->kids_cap * sizeof(*new_kids));
+		if (new_kids == NULL) {
+			err(1, NULL);
+		}
+		parent->kids = new_kids;
+	}
+	parent->kids[parent->nkids++] = kid;
+}
+
+static struct watch_node *kid_find(const struct watch_node *node, const char *name){
+	int i;
+
+	for (i = 0; i < node->nkids; i++) {
+		if (strcmp(node->kids[i]->name, name) == 0) {
+			return node->kids[i];
+		}
+	}
+	return NULL;
+}
+
+static void open_roots(void){
+	struct watch_node *node;
+	int i;
+
+	if ((roots = malloc((nroot_paths > 0 ? nroot_paths : 1) * sizeof(*roots))) == NULL) {
+		err(1, NULL);
+	}
+	nroots = 0;
+	for (i = 0; i < nroot_paths; i++) {
+		if ((node = node_open(NULL, AT_FDCWD, root_paths[i], root_paths[i])) != NULL) {
+			roots[nroots++] = node;
+		}
+	}
+}
+
+static void close_roots(void){
+	int i;
+
+	for (i = 0; i < nroots; i++) {
+		node_free(roots[i]);
+	}
+	free(roots);
+	roots = NULL;
+	nroots = 0;
+}
+
+/*our dir fd keeps a removed root alive, and its IN_DELETE_SELF back
+until it is closed, so look at the link count instead*/
+static void drop_removed_roots(void){
+	struct stat st;
+	int i;
+
+	for (i = 0; i < nroots; i++) {
+		if (fstat(roots[i]->dl.fd, &st) == 0 && st.st_nlink == 0) {
+			warnx("'%s' was removed", roots[i]->path);
+			node_free(roots[i]);
+			(void)memmove(&roots[i], &roots[i + 1], (nroots - i - 1) * sizeof(*roots));
+			nroots--;
+			i--;
+		}
+	}
+}
+
+/*block for events, then take more until they settle. false on errors*/
+static bool wait_events(void){
+	struct pollfd pfd;
+	int rounds;
+	int r;
+
+	out_flush();
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		warn("poll");
+		return false;
+	}
+	for (rounds = 0; rounds < WATCH_MAX_ROUNDS; rounds++) {
+		read_events();
+		if ((r = poll(&pfd, 1, WATCH_SETTLE_MS)) < 0 && errno != EINTR) {
+			warn("poll");
+			return false;
+		}
+		if (r == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+/*one read of the inotify fd, names noted against their nodes*/
+static void read_events(void){
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct watch_node *node;
+	ssize_t len;
+	char *p;
+
+	if ((len = read(ifd, buf, sizeof(buf))) <= 0) {
+		return;
+	}
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)(void *)p;
+		if (ev->mask & IN_Q_OVERFLOW) {
+			rescan = true;
+			continue;
+		}
+		if (ev->wd < 0 || ev->wd >= by_wd_cap || (node = by_wd[ev->wd]) == NULL) {
+			continue;
+		}
+		if (ev->mask & IN_DELETE_SELF) {
+			if (node->parent == NULL) {
+				warnx("'%s' was removed", node->path);
+			}
+			node_detach(node);
+			node_free(node);
+			continue;
+		}
+		if (ev->len > 0) {
+			note_change(node, ev->name);
+		}
+	}
+}
+
+static void note_change(struct watch_node *node, const char *name){
+	if (node->nchanged >= node->changed_cap) {
+		char **new_changed;
+
+		node->changed_cap = node->changed_cap == 0 ? 16 : node->changed_cap * 2;
+		new_changed = realloc(node->changed, node->changed_cap * sizeof(char *));
+		if (new_changed == NULL) {
+			err(1, NULL);
+		}
+		node->changed = new_changed;
+	}
+	if ((node->changed[node->nchanged++] = strdup(name)) == NULL) {
+		err(1, NULL);
+	}
+}
+
+/*first pass: stat the changed names, drop their old entries and the
+subdir nodes that are gone*/
+static void restat(struct watch_node *node){
+	struct file_entry *fe;
+	struct watch_node *kid;
+	int kept;
+	int r;
+	int n;
+	int i;
+
+	/*each name once*/
+	qsort(node->changed, node->nchanged, sizeof(char *), name_cmp);
+	n = 0;
+	for (i = 0; i < node->nchanged; i++) {
+		if (n > 0 && strcmp(node->changed[n - 1], node->changed[i]) == 0) {
+			free(node->changed[i]);
+			continue;
+		}
+		node->changed[n++] = node->changed[i];
+	}
+	node->nchanged = n;
+
+	if ((node->add = malloc(n * sizeof(struct file_entry))) == NULL) {
+		err(1, NULL);
+	}
+	node->nadd = 0;
+	for (i = 0; i < n; i++) {
+		if (!is_listed_name(node->changed[i], wopts)) {
+			continue;
+		}
+		/*--include/--exclude, as dents_next has it*/
+		r = wopts->filter != NULL ? filter_name(wopts->filter, node->changed[i]) : FILTER_LIST;
+		if (r == FILTER_DROP) {
+			continue;
+		}
+		stats_add(STATS_STATS, 1);
+		fe = &node->add[node->nadd];
+		if (meta_stat_at(node->dl.fd, node->changed[i], &plan, &fe->m) < 0 ||
+		    (r == FILTER_DIR && (!wopts->recursive || !S_ISDIR(fe->m.mode)))) {
+			fe = NULL;
+		} else {
+			if ((fe->name = arena_strdup(&node->dl.names, node->changed[i])) == NULL) {
+				err(1, NULL);
+			}
+			fe->link = NULL;
+			if (wants_link(wopts) && S_ISLNK(fe->m.mode)) {
+				stats_add(STATS_READLINKS, 1);
+				fe->link = read_link_at(node->dl.fd, fe->name, &node->dl.names);
+			}
+			node->nadd++;
+		}
+		/*a subdir that went away, or is no longer a dir*/
+		if ((fe == NULL || !is_recurse_dir(fe, wopts)) &&
+		    (kid = kid_find(node, node->changed[i])) != NULL) {
+			node_detach(kid);
+			node_free(kid);
+		}
+	}
+
+	/*old entries of changed names*/
+	kept = 0;
+	for (i = 0; i < node->dl.count; i++) {
+		fe = &node->dl.files[i];
+		if (bsearch(&fe->name, node->changed, n, sizeof(char *), name_cmp) != NULL) {
+			if (plan.need & META_STAT) {
+				node->dl.total_blocks -= fe->m.blocks;
+				node->dl.total_size_bytes -= fe->m.size;
+			}
+			node->garbage++;
+			continue;
+		}
+		node->dl.files[kept++] = *fe;
+	}
+	node->dl.count = kept;
+}
+
+/*second pass: sort the new entries, merge them in, open new subdirs*/
+static void merge(struct watch_node *node){
+	struct file_entry *files;
+	struct watch_node *kid;
+	char *kidpath;
+	int i;
+	int j;
+	int k;
+
+	sort_entries(node->add, node->nadd, wopts);
+	files = lib_realloc(node->dl.files, (node->dl.count + node->nadd + 1) * sizeof(struct file_entry));
+	if (files == NULL) {
+		err(1, NULL);
+	}
+	/*from the back, both runs are in order. -f just appends*/
+	i = node->dl.count - 1;
+	j = node->nadd - 1;
+	for (k = node->dl.count + node->nadd - 1; j >= 0; k--) {
+		if (i >= 0 && !wopts->unsorted && entry_cmp(&files[i], &node->add[j]) > 0) {
+			files[k] = files[i--];
+		} else {
+			files[k] = node->add[j--];
+		}
+	}
+	node->dl.files = files;
+	node->dl.count += node->nadd;
+
+	for (j = 0; j < node->nadd; j++) {
+		if (plan.need & META_STAT) {
+			node->dl.total_blocks += node->add[j].m.blocks;
+			node->dl.total_size_bytes += node->add[j].m.size;
+		}
+		if (!wopts->recursive || !is_within_depth(node->depth + 1, wopts) ||
+		    !is_recurse_dir(&node->add[j], wopts) ||
+		    kid_find(node, node->add[j].name) != NULL) {
+			continue;
+		}
+		if ((kidpath = build_path(node->path, node->add[j].name)) == NULL) {
+			err(1, NULL);
+		}
+		if ((kid = node_open(node, node->dl.fd, node->add[j].name, kidpath)) != NULL) {
+			kid_add(node, kid);
+		}
+		free(kidpath);
+	}
+
+	for (i = 0; i < node->nchanged; i++) {
+		free(node->changed[i]);
+	}
+	node->nchanged = 0;
+	free(node->add);
+	node->add = NULL;
+	node->nadd = 0;
+	if (node->garbage > WATCH_GARBAGE_MIN && node->garbage > node->dl.count) {
+		compact(node);
+	}
+}
+
+/*copy the live names to a new arena, the old one is mostly dead*/
+static void compact(struct watch_node *node){
+	struct file_entry *fe;
+	struct arena names;
+	int i;
+
+	arena_init(&names);
+	for (i = 0; i < node->dl.count; i++) {
+		fe = &node->dl.files[i];
+		if ((fe->name = arena_strdup(&names, fe->name)) == NULL ||
+		    (fe->link != NULL && (fe->link = arena_strdup(&names, fe->link)) == NULL)) {
+			err(1, NULL);
+		}
+	}
+	arena_free(&node->dl.names);
+	cache_release(&node->dl);
+	node->dl.names = names;
+	node->garbage = 0;
+}
+
+/*sort_entries order for two entries*/
+static int entry_cmp(const struct file_entry *a, const struct file_entry *b){
+	int c;
+
+	if (wopts->sort_time) {
+		c = compare_time(a, b);
+	} else if (wopts->sort_size) {
+		c = compare_size(a, b);
+	} else {
+		c = compare_names(a, b);
+	}
+	return wopts->reverse ? -c : c;
+}
+
+static int name_cmp(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*everything again, from the top of the screen on a terminal*/
+static void render(void){
+	int i;
+
+	if (isatty(STDOUT_FILENO)) {
+		out_str("\033[H\033[2J");
+	}
+	format_time_now();
+	for (i = 0; i < nroots; i++) {
+		if (i > 0 && !wopts->json) {
+			out_eol();
+		}
+		render_node(roots[i], nroot_paths > 1);
+	}
+	out_flush();
+}
+
+/*a node like recurse_at prints it, then its subdirs in listing order*/
+static void render_node(const struct watch_node *node, bool print_name){
+	const struct watch_node *kid;
+	int i;
+
+	if (print_name && !wopts->json) {
+		out_str(node->path);
+		out_char(':');
+		out_eol();
+	}
+	print_directory(&node->dl, wopts);
+	for (i = 0; i < node->dl.count && node->nkids > 0; i++) {
+		if (!is_recurse_dir(&node->dl.files[i], wopts) ||
+		    (kid = kid_find(node, node->dl.files[i].name)) == NULL) {
+			continue;
+		}
+		if (!wopts->json) {
+			out_eol();
+		}
+		render_node(kid, true);
+	}
+}
+
+#else
+
+void watch_run(char *const paths[], int n, const struct options *opts){
+	(void)paths;
+	(void)n;
+	(void)opts;
+	warnx("--watch needs inotify");
+}
+
+#endif